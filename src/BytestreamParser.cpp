@@ -1,14 +1,23 @@
 #include "BytestreamParser.hpp"
 #include <iostream>
 #include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <QThread>
+#include <QMetaObject>
 #include "utils.hpp"
+#include "SensorsProcessor.hpp"
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 namespace nst {
 
-BytestreamParser:: BytestreamParser(uint8_t id, DVSEvent::timeformat_t fmt)
-: QObject(), _id(id), _timeformat(fmt), _state(0), _response(new QString()), _ev(nullptr)
+BytestreamParser:: BytestreamParser(uint8_t id, DVSEvent::timeformat_t fmt, size_t queue_capacity)
+: QObject(), _id(id), _state(0), _events(queue_capacity), _samples(SAMPLE_QUEUE_CAPACITY), _stamps(STAMP_QUEUE_CAPACITY), _input(INPUT_QUEUE_CAPACITY)
 {
-	_response->reserve(64);
+	set_timeformat(fmt);
 }
 
 BytestreamParser::
@@ -23,95 +32,405 @@ id() const
 }
 
 
+/*
+ * number of timestamp bytes for each of the time formats
+ */
+template <DVSEvent::timeformat_t FMT> struct timeformat_traits;
+template <> struct timeformat_traits<DVSEvent::TIMEFORMAT_0BYTES> { static constexpr unsigned timestamp_bytes = 0; };
+template <> struct timeformat_traits<DVSEvent::TIMEFORMAT_2BYTES> { static constexpr unsigned timestamp_bytes = 2; };
+template <> struct timeformat_traits<DVSEvent::TIMEFORMAT_3BYTES> { static constexpr unsigned timestamp_bytes = 3; };
+template <> struct timeformat_traits<DVSEvent::TIMEFORMAT_4BYTES> { static constexpr unsigned timestamp_bytes = 4; };
+
+
+/*
+ * decode a complete event. the first byte carries the x coordinate (the high
+ * bit is the event marker), the second byte polarity and y coordinate. The
+ * timestamp follows in big endian byte order.
+ */
+template <DVSEvent::timeformat_t FMT>
+inline void
+decode_event(const uint8_t *b, const uint8_t id, DVSEvent &ev)
+{
+	ev.id = id;
+	ev.x = static_cast<uint16_t>(b[0]) & 0x7F;
+	ev.p = (b[1] & 0x80) >> 7;
+	ev.y = static_cast<uint16_t>(b[1]) & 0x7F;
+
+	uint64_t t = 0;
+	for (unsigned i = 0; i < timeformat_traits<FMT>::timestamp_bytes; ++i)
+		t = (t << 8) | b[2 + i];
+	ev.t = t;
+}
+
+
+/*
+ * find the first byte with the high bit set, i.e. the next possible start of
+ * an event. Response strings are plain ASCII, so everything in front of it
+ * belongs to a response.
+ */
+static inline const uint8_t*
+find_event_marker(const uint8_t *p, const uint8_t *end)
+{
+#if defined(__AVX2__)
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+		unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(v));
+		if (mask) return p + __builtin_ctz(mask);
+		p += 32;
+	}
+#endif
+#if defined(__SSE2__)
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(v));
+		if (mask) return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (p < end && !(*p & 0x80))
+		++p;
+	return p;
+}
+
+
 void BytestreamParser::
-parse(const unsigned char c)
-{
-	switch (_state) {
-	// there may be either a regular character from a response string, or an
-	// event starting. We can determine this information by looking at the
-	// high bit. If it is set, it is an event
-	case 0:
-		if ((c & 0x80) == 0) {
-			if (c == '\n') {
-				if (!_response)
-					std::cerr << "EE: BytestreamParser _response is nullptr where it should not be" << std::endl;
-				else
-					emit responseReceived(std::move(_response));
-
-				_response = new QString();
-				_response->reserve(64);
+parseResponse(const uint8_t *p, const uint8_t *end)
+{
+	while (p < end) {
+		auto nl = static_cast<const uint8_t*>(std::memchr(p, '\n', end - p));
+		auto stop = nl ? nl : end;
+
+		// responses are plain text. anything else is a sign that the
+		// parser got out of sync
+		for (const uint8_t *c = p; c < stop; ++c) {
+			if (*c < 0x20 && *c != '\r' && *c != '\t') {
+				++_suspects;
+				break;
 			}
-			else
-				_response->append(c);
 		}
-		else {
-			_ev = new DVSEvent;
-			_ev->id = _id;
-			_ev->x = static_cast<uint16_t>(c) & 0x7F;
-			_ev->y = 0;
-			_ev->p = 0;
-			_ev->t = 0;
-			++_state;
+
+		// overlong lines get truncated
+		size_t n = std::min<size_t>(stop - p, RESPONSE_LINE_MAX - _line_len);
+		std::memcpy(_line + _line_len, p, n);
+		_line_len += n;
+		if (!nl) break;
+
+		finishResponse();
+		p = nl + 1;
+	}
+}
+
+
+void BytestreamParser::
+finishResponse()
+{
+	_line[_line_len] = '\0';
+
+	// sensor lines never leave the parser as a string
+	if (isSensorLine(_line, _line_len)) {
+		IMUSample sample;
+		if (decodeSensorLine(_line, _line_len, sample)) {
+			_samples.push(sample);
+			if (_metrics) RobotMetrics::add(_metrics->imu_samples, 1);
+			if (!_wakeup_pending.exchange(true))
+				emit eventsAvailable();
 		}
-		break;
+	}
+	else {
+		if (_metrics) RobotMetrics::add(_metrics->responses, 1);
+		emit responseReceived(new QString(QString::fromLatin1(_line, _line_len)));
+	}
+
+	_line_len = 0;
+}
+
+
+/*
+ * turn a raw timestamp of the retina into a monotonic one. A timestamp that is
+ * smaller than its predecessor means that the retina's clock wrapped around.
+ * Note that wrap-arounds can not be detected if there is no event for half a
+ * period of the clock (32ms for 2 byte timestamps), which is unusual given
+ * the noise rate of the retina.
+ *
+ * Formats without a timestamp get the time at which their chunk was read.
+ */
+template <DVSEvent::timeformat_t FMT>
+inline uint64_t BytestreamParser::
+unwrapTimestamp(uint64_t t)
+{
+	constexpr unsigned BITS = 8 * timeformat_traits<FMT>::timestamp_bytes;
+	if (BITS == 0)
+		return _t_chunk;
+
+	// the clock moves by far less than half its period from one event to
+	// the next. Events that were decoded from the wrong offset jump around,
+	// so they neither count as wrap-arounds nor become the reference for
+	// the next event. They get the last good time, as t must not go
+	// backwards
+	constexpr uint64_t MASK = (uint64_t(1) << BITS) - 1;
+	_t_raw = t;
+	if (!_t_reference) {
+		// the first event after a reset has nothing to be checked
+		// against. It is also what a resync returns to until the first
+		// good window
+		_t_last = _t_good_last = t;
+		_t_good_epoch = _t_epoch;
+		_t_reference = true;
+	}
+	else if (((t - _t_last) & MASK) > MASK / 2) {
+		++_suspects;
+		t = _t_last;
+	}
+	else {
+		if (t < _t_last)
+			_t_epoch += uint64_t(1) << BITS;
+		_t_last = t;
+	}
+	t += _t_epoch;
+
+	// the first event of an epoch anchors device time on the host clock,
+	// or is the origin of device time. The offset may wrap, the sum does
+	// not
+	if (!_t_anchored) {
+		_t_offset = (_t_mode == DVSEvent::TIMESTAMP_HOST ? monotonic_us() : 0) - t;
+		_t_anchored = true;
+	}
+	return t + _t_offset;
+}
+
+
+template <DVSEvent::timeformat_t FMT>
+void BytestreamParser::
+parseKernel(const uint8_t *p, const uint8_t *end)
+{
+	constexpr unsigned N = 2 + timeformat_traits<FMT>::timestamp_bytes;
+
+	// events are collected in batches before they go to the queue
+	constexpr size_t BATCH_SIZE = 256;
+	DVSEvent batch[BATCH_SIZE];
+	size_t nbatch = 0;
+	const uint8_t *begin = p;
+
+	// complete an event that was cut off at the end of the previous chunk
+	if (_state > 0) {
+		while (_state < N && p < end)
+			_partial[_state++] = *p++;
+		if (_state < N) return;
 
-	case 1:
-		_ev->p = (static_cast<uint8_t>(c) & 0x80) >> 7;
-		_ev->y = static_cast<uint16_t>(c) & 0x7F;
-		if (_timeformat == DVSEvent::TIMEFORMAT_0BYTES) {
-			emit eventReceived(std::move(_ev));
-			_ev = nullptr;
-			_state = 0;
+		decode_event<FMT>(_partial, _id, batch[nbatch]);
+		batch[nbatch].t = unwrapTimestamp<FMT>(batch[nbatch].t);
+		++nbatch;
+		_state = 0;
+
+		if (++_window_events == RESYNC_WINDOW && !windowPlausible())
+			p = resync<FMT>(p, begin, end);
+	}
+
+	while (p < end) {
+		// there may be either a regular character from a response
+		// string, or an event starting. We can determine this
+		// information by looking at the high bit. If it is set, it is
+		// an event. Most of the stream consists of events, so decode
+		// runs of them in one go
+		while (end - p >= N && (*p & 0x80)) {
+			decode_event<FMT>(p, _id, batch[nbatch]);
+			batch[nbatch].t = unwrapTimestamp<FMT>(batch[nbatch].t);
+			++nbatch;
+			p += N;
+
+			if (nbatch == BATCH_SIZE) {
+				_seq += _events.push(batch, nbatch);
+				nbatch = 0;
+			}
+
+			if (++_window_events == RESYNC_WINDOW && !windowPlausible())
+				p = resync<FMT>(p, begin, end);
 		}
-		else
-			++_state;
-		break;
+		if (p == end) break;
 
-	case 2:
-		if (_timeformat == DVSEvent::TIMEFORMAT_2BYTES)
-			_ev->t |= static_cast<uint64_t>(c) << 8;
-		else
-			_ev->t |= static_cast<uint64_t>(c) << 16;
-		++_state;
-		break;
+		// an event that is cut off at the end of the chunk
+		if (*p & 0x80) {
+			_state = end - p;
+			std::copy(p, end, _partial);
+			break;
+		}
+
+		// a run of response characters, up to the next event
+		const uint8_t *q = find_event_marker(p, end);
+		parseResponse(p, q);
+		p = q;
+	}
+
+	_seq += _events.push(batch, nbatch);
+}
+
+
+bool BytestreamParser::
+windowPlausible()
+{
+	// a single garbage event may already have counted a wrap-around, so
+	// only windows without any suspects are good enough to return to
+	const bool plausible = _suspects < RESYNC_THRESHOLD;
+	if (_suspects == 0) {
+		_t_good_last = _t_last;
+		_t_good_epoch = _t_epoch;
+	}
+	_window_events = 0;
+	_suspects = 0;
+	return plausible;
+}
 
-	case 3:
-		if (_timeformat == DVSEvent::TIMEFORMAT_2BYTES) {
-			_ev->t |= static_cast<uint64_t>(c);
-			emit eventReceived(std::move(_ev));
-			_ev = nullptr;
-			_state = 0;
+
+/*
+ * the event marker repeats every N bytes at the right offset, but hardly ever
+ * at a wrong one. Note that the second byte of an event carries the
+ * polarity in its high bit, so a run of ON events also matches one byte off
+ */
+template <unsigned N>
+static inline bool
+markers_repeat(const uint8_t *p, const uint8_t *end, unsigned run)
+{
+	if (end - p < static_cast<ptrdiff_t>(run * N)) return false;
+	for (unsigned i = 0; i < run; ++i)
+		if (!(p[i * N] & 0x80)) return false;
+	return true;
+}
+
+
+template <DVSEvent::timeformat_t FMT>
+const uint8_t* BytestreamParser::
+resync(const uint8_t *next, const uint8_t *begin, const uint8_t *end)
+{
+	constexpr unsigned N = 2 + timeformat_traits<FMT>::timestamp_bytes;
+	constexpr unsigned BITS = 8 * timeformat_traits<FMT>::timestamp_bytes;
+
+	// not enough data left to tell, the next window will show
+	if (end - next < static_cast<ptrdiff_t>(RESYNC_RUN * N))
+		return next;
+
+	// the stream is aligned. Either the clock jumped, or the parser found
+	// back into the stream by itself. Continue from the last good window
+	// with the clock as it is now. A jump backwards can only be told apart
+	// from a wrap-around by its size, and counts as one so that t keeps
+	// increasing
+	if (markers_repeat<N>(next, end, RESYNC_RUN)) {
+		if (BITS > 0) {
+			_t_epoch = _t_good_epoch;
+			if (_t_raw < _t_good_last)
+				_t_epoch += uint64_t(1) << BITS;
+			_t_last = _t_raw;
 		}
-		else {
-			_ev->t |= static_cast<uint64_t>(c) << 8;
-			++_state;
+		return next;
+	}
+
+	// search the other offsets, starting right after the beginning of the
+	// last event
+	const uint8_t *q = next - begin >= N ? next - N + 1 : begin;
+	while (end - q >= static_cast<ptrdiff_t>(RESYNC_RUN * N) && (q == next || !markers_repeat<N>(q, end, RESYNC_RUN)))
+		++q;
+	if (end - q < static_cast<ptrdiff_t>(RESYNC_RUN * N))
+		return next;
+
+	// the garbage events counted wrap-arounds that did not happen, and
+	// the current response line is garbage as well
+	_resyncs.fetch_add(1, std::memory_order_relaxed);
+	_t_last = _t_good_last;
+	_t_epoch = _t_good_epoch;
+	_line_len = 0;
+	return q;
+}
+
+
+void BytestreamParser::
+resetStream()
+{
+	_state = 0;
+	_line_len = 0;
+	_window_events = 0;
+	_suspects = 0;
+	_t_good_last = 0;
+	_t_good_epoch = 0;
+	resetTimestamps();
+}
+
+
+uint64_t BytestreamParser::
+resyncs() const
+{
+	return _resyncs.load(std::memory_order_relaxed);
+}
+
+
+void BytestreamParser::
+parseData(const char *data, size_t len, uint64_t t_read)
+{
+	if (t_read == 0) t_read = monotonic_us();
+
+	// events without a timestamp of their own are stamped with the time
+	// at which the chunk was read
+	if (_timeformat == DVSEvent::TIMEFORMAT_0BYTES) {
+		_t_chunk = t_read;
+		if (!_t_anchored) {
+			_t_offset = _t_chunk;
+			_t_anchored = true;
 		}
-		break;
+		if (_t_mode == DVSEvent::TIMESTAMP_DEVICE)
+			_t_chunk -= _t_offset;
+	}
 
-	case 4:
-		_ev->t |= static_cast<uint64_t>(c);
-		emit eventReceived(std::move(_ev));
-		_ev = nullptr;
-		_state = 0;
-		break;
+	const uint8_t *p = reinterpret_cast<const uint8_t*>(data);
+	const uint64_t seq = _seq;
+	(this->*_kernel)(p, p + len);
 
-	default:
-		// TODO: report the error to some other function, don't just
-		// print it
-		// found a state that should not be there. exit
-		std::cerr << "EE: BytestreamParser in unknown state. resetting" << std::endl;
-		_state = 0;
-		break;
+	if (_seq != seq) {
+		_stamps.push({t_read, _seq});
+		if (_latency) _latency->decode.record(monotonic_us() - t_read);
+		if (_metrics) RobotMetrics::add(_metrics->events_decoded, _seq - seq);
 	}
 
+	if (_events.size() >= _wakeup_threshold && !_wakeup_pending.exchange(true))
+		emit eventsAvailable();
+}
+
+
+bool BytestreamParser::
+pushData(const ReceiveBufferPtr &buf)
+{
+	bool result = _input.push(buf);
+	if (!_input_wakeup_pending.exchange(true))
+		QMetaObject::invokeMethod(this, "processInput", Qt::QueuedConnection);
+	return result;
+}
+
+
+uint64_t BytestreamParser::
+inputDrops() const
+{
+	return _input.drops();
 }
 
 
 void BytestreamParser::
-parseData(const QByteArray &data)
+processInput()
 {
-	for (const char c: data)
-		this->parse(static_cast<unsigned char>(c));
+	// acknowledge first, so that the producer will wake us up again if it
+	// pushes while we drain the queue
+	_input_wakeup_pending.store(false);
+
+	// the buffer goes back to its pool right after it was decoded
+	ReceiveBufferPtr buf;
+	size_t n = 0;
+	while (n < PARSE_QUANTUM && _input.pop(buf)) {
+		if (buf->streamStart())
+			resetStream();
+		parseData(buf->data(), buf->size(), buf->readTime());
+		n += buf->size();
+		buf.reset();
+	}
+
+	// go to the back of the thread's event queue for the rest
+	if (!_input.empty() && !_input_wakeup_pending.exchange(true))
+		QMetaObject::invokeMethod(this, "processInput", Qt::QueuedConnection);
 }
 
 
@@ -119,6 +438,123 @@ void BytestreamParser::
 set_timeformat(DVSEvent::timeformat_t fmt)
 {
 	_timeformat = fmt;
+
+	// select the decoder once instead of checking the format for every
+	// byte. a partially received event is meaningless in the new format
+	switch (fmt) {
+	case DVSEvent::TIMEFORMAT_0BYTES:
+		_kernel = &BytestreamParser::parseKernel<DVSEvent::TIMEFORMAT_0BYTES>;
+		break;
+	case DVSEvent::TIMEFORMAT_2BYTES:
+		_kernel = &BytestreamParser::parseKernel<DVSEvent::TIMEFORMAT_2BYTES>;
+		break;
+	case DVSEvent::TIMEFORMAT_3BYTES:
+		_kernel = &BytestreamParser::parseKernel<DVSEvent::TIMEFORMAT_3BYTES>;
+		break;
+	case DVSEvent::TIMEFORMAT_4BYTES:
+		_kernel = &BytestreamParser::parseKernel<DVSEvent::TIMEFORMAT_4BYTES>;
+		break;
+	}
+	_state = 0;
+
+	// timestamps of different widths can not be compared
+	resetTimestamps();
+}
+
+
+void BytestreamParser::
+setTimestampMode(DVSEvent::timestamp_mode_t mode)
+{
+	_t_mode = mode;
+	resetTimestamps();
+}
+
+
+DVSEvent::timestamp_mode_t BytestreamParser::
+timestampMode() const
+{
+	return _t_mode;
+}
+
+
+void BytestreamParser::
+resetTimestamps()
+{
+	// make sure to call in the correct thread
+	if (thread() != QThread::currentThread()) {
+		QMetaObject::invokeMethod(this, "resetTimestamps", Qt::QueuedConnection);
+		return;
+	}
+
+	_t_last = 0;
+	_t_raw = 0;
+	_t_epoch = 0;
+	_t_offset = 0;
+	_t_reference = false;
+	_t_anchored = false;
+}
+
+
+DVSEvent::timeformat_t BytestreamParser::
+timeformat() const
+{
+	return _timeformat;
+}
+
+
+SPSCQueue<DVSEvent>* BytestreamParser::
+eventQueue()
+{
+	return &_events;
+}
+
+
+SPSCQueue<IMUSample>* BytestreamParser::
+sampleQueue()
+{
+	return &_samples;
+}
+
+
+SPSCQueue<ChunkStamp>* BytestreamParser::
+stampQueue()
+{
+	return &_stamps;
+}
+
+
+void BytestreamParser::
+setLatencyStats(std::shared_ptr<LatencyStats> stats)
+{
+	_latency = std::move(stats);
+}
+
+
+void BytestreamParser::
+setMetrics(std::shared_ptr<RobotMetrics> metrics)
+{
+	_metrics = std::move(metrics);
+}
+
+
+void BytestreamParser::
+setWakeupThreshold(size_t n)
+{
+	_wakeup_threshold = n;
+}
+
+
+size_t BytestreamParser::
+wakeupThreshold() const
+{
+	return _wakeup_threshold;
+}
+
+
+void BytestreamParser::
+acknowledgeWakeup()
+{
+	_wakeup_pending.store(false);
 }
 
 
@@ -1,10 +1,16 @@
 #ifndef __BYTESTREAMPARSER_HPP__4FA5A548_1B33_4536_8BCA_39DE7D602068
 #define __BYTESTREAMPARSER_HPP__4FA5A548_1B33_4536_8BCA_39DE7D602068
 
+#include <atomic>
+#include <memory>
 #include <QObject>
 #include <QString>
 #include <QByteArray>
 #include "Datatypes.hpp"
+#include "SPSCQueue.hpp"
+#include "LatencyHistogram.hpp"
+#include "RobotMetrics.hpp"
+#include "ReceiveBufferPool.hpp"
 
 // TODO: smart pointers for the response string and events?
 
@@ -12,33 +18,227 @@ namespace nst {
 
 /**
  * state machine to parse a bytestream. it will eventually emit an event when
- * new data has arrived, i.e. either a command response or an event.
+ * new data has arrived, i.e. a command response.
+ *
+ * decoded DVS events are not emitted one by one. They are written to a
+ * lock-free queue which is drained by exactly one consumer in another thread.
+ * The consumer gets woken up via eventsAvailable() as soon as the queue holds
+ * at least wakeupThreshold() events. Only one wakeup will be pending at any
+ * time, and the consumer is expected to call acknowledgeWakeup() before
+ * draining the queue. Events below the threshold are expected to be picked up
+ * by the consumer periodically.
+ *
+ * response lines are collected in a fixed buffer. IMU lines are decoded
+ * right there and go to a second queue, which also triggers a wakeup. Only
+ * other responses are turned into a QString and emitted.
+ *
+ * raw data arrives as receive buffers through pushData(), which can be called
+ * from the connection's thread. The buffers are queued by reference and
+ * decoded in place in the parser's thread, so the parser itself does not copy
+ * the data. Parsers of several robots may
+ * share a thread, so that each one decodes at most PARSE_QUANTUM bytes at a
+ * time before it yields to the others.
+ *
+ * the stream has no framing apart from the marker bit of events, so a lost
+ * byte makes the parser decode garbage. It therefore keeps track of events
+ * with implausible timestamps and of control characters within responses.
+ * If too many of them show up within RESYNC_WINDOW events, it checks whether
+ * the next RESYNC_RUN events still start with the marker. If so, the clock
+ * jumped and is taken as it is. Otherwise it searches for the offset at which
+ * they do and continues there. Implausible timestamps are replaced with the
+ * last good one. Buffers that start a new connection reset the parser.
  */
 class BytestreamParser : public QObject
 {
 	Q_OBJECT
 
 public:
-	BytestreamParser(const uint8_t id, DVSEvent::timeformat_t fmt = DVSEvent::TIMEFORMAT_3BYTES);
+	static constexpr size_t DEFAULT_QUEUE_CAPACITY = 1 << 17;
+	static constexpr size_t DEFAULT_WAKEUP_THRESHOLD = 512;
+	static constexpr size_t SAMPLE_QUEUE_CAPACITY = 256;
+	static constexpr size_t RESPONSE_LINE_MAX = 255;
+	static constexpr size_t STAMP_QUEUE_CAPACITY = 4096;
+	static constexpr size_t PARSE_QUANTUM = 1 << 16;
+	static constexpr size_t INPUT_QUEUE_CAPACITY = 128;
+	static constexpr unsigned RESYNC_WINDOW = 64;
+	static constexpr unsigned RESYNC_THRESHOLD = 8;
+	static constexpr unsigned RESYNC_RUN = 8;
+
+	BytestreamParser(const uint8_t id,
+			DVSEvent::timeformat_t fmt = DVSEvent::TIMEFORMAT_3BYTES,
+			size_t queue_capacity = DEFAULT_QUEUE_CAPACITY);
 	virtual ~BytestreamParser();
+	/*
+	 * set the time format of the event stream. this selects the decoder
+	 * and needs to be called from the parser's thread (or before data
+	 * arrives)
+	 */
 	void set_timeformat(DVSEvent::timeformat_t fmt);
+	DVSEvent::timeformat_t timeformat() const;
 	uint8_t id() const;
 
+	/*
+	 * select whether timestamps count from the first event of the
+	 * connection, or are mapped onto the host's monotonic clock. Same
+	 * restrictions as for set_timeformat apply
+	 */
+	void setTimestampMode(DVSEvent::timestamp_mode_t mode);
+	DVSEvent::timestamp_mode_t timestampMode() const;
+
+	/*
+	 * queue that receives all decoded events
+	 */
+	SPSCQueue<DVSEvent>* eventQueue();
+
+	/*
+	 * queue that receives all decoded IMU samples
+	 */
+	SPSCQueue<IMUSample>* sampleQueue();
+
+	/*
+	 * queue that receives one stamp for each chunk that contained events
+	 */
+	SPSCQueue<ChunkStamp>* stampQueue();
+
+	/*
+	 * histograms to which the parser adds the decode latency. set this
+	 * before data arrives
+	 */
+	void setLatencyStats(std::shared_ptr<LatencyStats> stats);
+
+	/*
+	 * counters to which the parser adds decoded events, IMU samples and
+	 * responses. set this before data arrives
+	 */
+	void setMetrics(std::shared_ptr<RobotMetrics> metrics);
+
+	/*
+	 * queue a buffer for parsing. This is the producer side of the input
+	 * queue, i.e. it must always be called from the same thread. Returns
+	 * false if the queue was full and the buffer got dropped
+	 */
+	bool pushData(const ReceiveBufferPtr &buf);
+
+	/*
+	 * number of buffers that did not fit into the input queue
+	 */
+	uint64_t inputDrops() const;
+
+	/*
+	 * number of times the parser lost track of the stream and searched
+	 * for the next event
+	 */
+	uint64_t resyncs() const;
+
+	void setWakeupThreshold(size_t n);
+	size_t wakeupThreshold() const;
+	void acknowledgeWakeup();
+
+	/*
+	 * parse a chunk of data that was read at t_read (monotonic_us) right
+	 * away in the caller's thread, without the input queue. 0 means that
+	 * the chunk was read just now. Only for callers that own the parser's
+	 * thread, e.g. benchmarks
+	 */
+	void parseData(const char *data, size_t len, uint64_t t_read = 0);
+
 public slots:
-	void parseData(const QByteArray &data);
+	/*
+	 * start a new timestamp epoch, e.g. when the connection was
+	 * re-established and the retina's clock started over
+	 */
+	void resetTimestamps();
 
 signals:
-	void eventReceived(DVSEvent *ev);
+	void eventsAvailable();
 	void responseReceived(QString *str);
 
+private slots:
+	void processInput();
+
 private:
-	void parse(const unsigned char c);
+	/*
+	 * decode a buffer with a fixed time format. there is one
+	 * specialization per format, the right one is selected in
+	 * set_timeformat
+	 */
+	template <DVSEvent::timeformat_t FMT>
+	void parseKernel(const uint8_t *p, const uint8_t *end);
+	void parseResponse(const uint8_t *p, const uint8_t *end);
+	void finishResponse();
+
+	/*
+	 * called after RESYNC_WINDOW events. Returns false if too many of
+	 * them looked implausible
+	 */
+	bool windowPlausible();
+
+	/*
+	 * called after a window that did not look right, with next pointing
+	 * after its last event. Returns where the next event starts: next
+	 * itself if the stream is still aligned, otherwise the first offset
+	 * after begin at which the events look right
+	 */
+	template <DVSEvent::timeformat_t FMT>
+	const uint8_t* resync(const uint8_t *next, const uint8_t *begin, const uint8_t *end);
+
+	/*
+	 * forget everything about the previous stream
+	 */
+	void resetStream();
+
+	template <DVSEvent::timeformat_t FMT>
+	uint64_t unwrapTimestamp(uint64_t t);
+
+	typedef void (BytestreamParser::*kernel_t)(const uint8_t*, const uint8_t*);
 
 	const uint8_t _id;
 	DVSEvent::timeformat_t _timeformat;
-	int _state;
-	QString *_response = nullptr;
-	DVSEvent *_ev = nullptr;
+	kernel_t _kernel = nullptr;
+
+	// bytes of an event that was cut off at the end of a chunk. _state is
+	// the number of bytes that were already received
+	uint8_t _partial[8];
+	unsigned _state;
+
+	// timestamp unwrapping. _t_epoch accumulates the wrap-arounds of the
+	// retina's clock, _t_offset maps device time to the configured clock.
+	// _t_last only serves as reference once _t_reference is set
+	DVSEvent::timestamp_mode_t _t_mode = DVSEvent::TIMESTAMP_DEVICE;
+	uint64_t _t_last = 0;
+	uint64_t _t_raw = 0;
+	uint64_t _t_epoch = 0;
+	uint64_t _t_offset = 0;
+	uint64_t _t_chunk = 0;
+	bool _t_reference = false;
+	bool _t_anchored = false;
+
+	// stream plausibility. _suspects counts the implausible events and
+	// responses of the current window. The timestamp state is saved after
+	// each window without any of them, so that it can be restored after
+	// the parser got out of sync
+	unsigned _window_events = 0;
+	unsigned _suspects = 0;
+	uint64_t _t_good_last = 0;
+	uint64_t _t_good_epoch = 0;
+	std::atomic<uint64_t> _resyncs{0};
+
+	// response line that is currently received
+	char _line[RESPONSE_LINE_MAX + 1];
+	size_t _line_len = 0;
+
+	SPSCQueue<DVSEvent> _events;
+	SPSCQueue<IMUSample> _samples;
+	SPSCQueue<ChunkStamp> _stamps;
+	uint64_t _seq = 0;
+	std::shared_ptr<LatencyStats> _latency;
+	std::shared_ptr<RobotMetrics> _metrics;
+	size_t _wakeup_threshold = DEFAULT_WAKEUP_THRESHOLD;
+	std::atomic<bool> _wakeup_pending{false};
+
+	// buffers that wait for their turn
+	SPSCQueue<ReceiveBufferPtr> _input;
+	std::atomic<bool> _input_wakeup_pending{false};
 };
 
 } // nst::
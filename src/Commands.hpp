@@ -2,23 +2,84 @@
 #define __COMMANDS_HPP__DE8555E9_1B8E_47A6_BF34_8AE88A27C9BE
 
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <string>
-#include <sstream>
 #include <QTcpSocket>
 #include <QSerialPort>
+#include "LinuxSerialPort.hpp"
 
 namespace nst {
 namespace commands {
 
 
+/**
+ * maximum length of a serialized command, except for plain command strings.
+ * A buffer of this size on the stack is sufficient to serialize any of them
+ */
+static constexpr size_t COMMAND_MAX_LENGTH = 64;
+
+
+/*
+ * formatting helpers for serialization. They do not check for the end of the
+ * buffer, the commands make sure that their output fits COMMAND_MAX_LENGTH
+ */
+inline char*
+put_str(char *p, const char *s)
+{
+	while (*s) *p++ = *s++;
+	return p;
+}
+
+inline char*
+put_uint(char *p, unsigned v)
+{
+	char tmp[10];
+	unsigned n = 0;
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n) *p++ = tmp[--n];
+	return p;
+}
+
+inline char*
+put_int(char *p, int v)
+{
+	if (v < 0) {
+		*p++ = '-';
+		return put_uint(p, 0u - static_cast<unsigned>(v));
+	}
+	return put_uint(p, static_cast<unsigned>(v));
+}
+
+
 /**
  * Command - Abstract command interface
  */
 struct Command
 {
 	virtual ~Command() {}
-	virtual const std::string toString() const = 0;
+
+	/*
+	 * write the command to buf and return its length. If the length is
+	 * larger than len, the content of buf is undefined and a larger buffer
+	 * is required
+	 */
+	virtual size_t serialize(char *buf, size_t len) const = 0;
+
+	virtual const std::string toString() const
+	{
+		char buf[COMMAND_MAX_LENGTH];
+		size_t n = serialize(buf, sizeof(buf));
+		return n <= sizeof(buf) ? std::string(buf, n) : std::string();
+	}
+
+	// arrival time (monotonic_us) of the data that caused this command, or
+	// 0. Used to measure the latency from input to output
+	uint64_t t_origin = 0;
 };
 
 
@@ -29,6 +90,13 @@ struct CommandString : public Command
 {
 	CommandString(std::string cmd) : _cmd(cmd) {}
 	virtual ~CommandString() {}
+
+	size_t serialize(char *buf, size_t len) const override
+	{
+		if (_cmd.size() <= len) std::memcpy(buf, _cmd.data(), _cmd.size());
+		return _cmd.size();
+	}
+
 	const std::string toString() const override {
 		return _cmd;
 	}
@@ -44,12 +112,10 @@ struct MotorDriver : Command
 {
 	MotorDriver(bool enabled = true) : _enabled(enabled) {}
 
-	const std::string toString() const override
+	size_t serialize(char *buf, size_t len) const override
 	{
-		if (this->_enabled)
-			return std::string("!M+\n");
-		else
-			return std::string("!M-\n");
+		if (len < COMMAND_MAX_LENGTH) return COMMAND_MAX_LENGTH;
+		return put_str(buf, this->_enabled ? "!M+\n" : "!M-\n") - buf;
 	}
 
 	void enable() { this->_enabled = true; }
@@ -67,12 +133,10 @@ struct DVS : Command
 {
 	DVS(bool enabled = true) : _enabled(enabled) {}
 
-	const std::string toString() const override
+	size_t serialize(char *buf, size_t len) const override
 	{
-		if (this->_enabled)
-			return std::string("E+\n!E3\n");
-		else
-			return std::string("E-\n");
+		if (len < COMMAND_MAX_LENGTH) return COMMAND_MAX_LENGTH;
+		return put_str(buf, this->_enabled ? "E+\n!E3\n" : "E-\n") - buf;
 	}
 
 	void enable() { this->_enabled = true; }
@@ -90,13 +154,14 @@ struct IMU : Command
 {
 	IMU(bool enabled = true) : _enabled(enabled) {}
 
-	const std::string toString() const override
+	size_t serialize(char *buf, size_t len) const override
 	{
+		if (len < COMMAND_MAX_LENGTH) return COMMAND_MAX_LENGTH;
 		if(this->_enabled)
 			// enable streaming for 3D gyro, acc, mag (bitmask 7168) @ 125Hz
-			return std::string("!S+7168,8\n");
+			return put_str(buf, "!S+7168,8\n") - buf;
 		else
-			return std::string("!S-\n");
+			return put_str(buf, "!S-\n") - buf;
 	}
 	void enable()  {this->_enabled = true; }
 	void disable() {this->_enabled = false; }
@@ -113,12 +178,20 @@ private:
 template <const char P>
 struct freq_base_t : Command
 {
-	const std::string toString() const override
+	size_t serialize(char *buf, size_t len) const override
 	{
-		std::stringstream ss;
-		ss << "!P" << P << "=" << std::to_string(_base_freq) << "\n";
-		ss << "!P" << P << "0=" << std::to_string(_absolute_freq) << "\n";
-		return ss.str();
+		if (len < COMMAND_MAX_LENGTH) return COMMAND_MAX_LENGTH;
+		const char prefix[] = {'!', 'P', P, '\0'};
+		char *p = buf;
+		p = put_str(p, prefix);
+		p = put_str(p, "=");
+		p = put_uint(p, _base_freq);
+		p = put_str(p, "\n");
+		p = put_str(p, prefix);
+		p = put_str(p, "0=");
+		p = put_uint(p, _absolute_freq);
+		p = put_str(p, "\n");
+		return p - buf;
 	}
 
 	void setFrequency(unsigned base_freq, float relative_freq)
@@ -182,13 +255,18 @@ struct LED : Command // not derived from freq_base_t to account for the two LEDs
 	LED(unsigned base_freq = 0u, float relative_freq_front = 0.0f, float relative_freq_back = 0.0f)
 	{ setFrequency(base_freq, relative_freq_front, relative_freq_back); }
 
-	const std::string toString() const override
+	size_t serialize(char *buf, size_t len) const override
 	{
-		std::stringstream ss;
-		ss << "!PC=" << std::to_string(_base_freq) << "\n";
-		ss << "!PC0=" << std::to_string(_absolute_freq_back) << "\n";
-		ss << "!PC1=" << std::to_string(_absolute_freq_front) << "\n";
-		return ss.str();
+		if (len < COMMAND_MAX_LENGTH) return COMMAND_MAX_LENGTH;
+		char *p = buf;
+		p = put_str(p, "!PC=");
+		p = put_uint(p, _base_freq);
+		p = put_str(p, "\n!PC0=");
+		p = put_uint(p, _absolute_freq_back);
+		p = put_str(p, "\n!PC1=");
+		p = put_uint(p, _absolute_freq_front);
+		p = put_str(p, "\n");
+		return p - buf;
 	}
 
 	void setFrequency(unsigned base_freq, float relative_freq_front, float relative_freq_back)
@@ -239,17 +317,18 @@ struct BoardLED : Command
 
 	BoardLED(boardled_mode_t mode = LED_MODE_OFF) : _mode(mode) {}
 
-	const std::string toString() const override
+	size_t serialize(char *buf, size_t len) const override
 	{
+		if (len < COMMAND_MAX_LENGTH) return COMMAND_MAX_LENGTH;
 		switch (_mode) {
 		case LED_MODE_OFF:
-			return std::string("!L0\n");
+			return put_str(buf, "!L0\n") - buf;
 		case LED_MODE_ON:
-			return std::string("!L1\n");
+			return put_str(buf, "!L1\n") - buf;
 		case LED_MODE_BLINKING:
-			return std::string("!L2\n");
+			return put_str(buf, "!L2\n") - buf;
 		default:
-			return std::string("");
+			return 0;
 		}
 	}
 
@@ -262,44 +341,73 @@ private:
 
 
 /**
- * mdw_base_t - Base class for all motor duty width / velocity commands
+ * MotorCommand - duty width or velocity of one motor.
+ *
+ * In contrast to all other commands, motor commands are plain values. They are
+ * sent at high rates, and can be copied to the connection without allocating
+ * memory.
  *
  * TODO: check if the widths are really correct for DW
  */
-template <unsigned MOTORID>
-struct md_base_t
+struct MotorCommand
 {
+	typedef enum {
+		DUTY_WIDTH,		// DW : Duty Width
+		DUTY_WIDTH_DECAY,	// DWD: Duty Width with Decay
+		VELOCITY,		// V  : Velocity
+		VELOCITY_DECAY		// VD : Velocity with Decay
+	} motorcmd_t;
 
-	md_base_t(int width) : _width(width) { validate(); }
-	void setWidth(int width) { _width = width; validate(); }
+	MotorCommand(motorcmd_t type = VELOCITY, unsigned motor = 0, int width = 0)
+	: type(type), motor(motor)
+	{ setWidth(width); }
 
-protected:
-	const unsigned _id = MOTORID;
-	int _width;
+	void setWidth(int width)
+	{
+		if (width >  100) width =  100;
+		if (width < -100) width = -100;
+		_width = width;
+	}
 
-private:
-	void validate()
+	int width() const { return _width; }
+
+	size_t serialize(char *buf, size_t len) const
+	{
+		static const char *prefix[] = {"!M", "!MD", "!MV", "!MVD"};
+		if (len < COMMAND_MAX_LENGTH) return COMMAND_MAX_LENGTH;
+		char *p = buf;
+		p = put_str(p, prefix[type]);
+		p = put_uint(p, motor);
+		p = put_str(p, "=");
+		p = put_int(p, _width);
+		p = put_str(p, "\n");
+		return p - buf;
+	}
+
+	const std::string toString() const
 	{
-		if (_width >  100) _width =  100;
-		if (_width < -100) _width = -100;
+		char buf[COMMAND_MAX_LENGTH];
+		return std::string(buf, serialize(buf, sizeof(buf)));
 	}
+
+	motorcmd_t type;
+	unsigned motor;
+
+	// see Command::t_origin
+	uint64_t t_origin = 0;
+
+private:
+	int _width;
 };
 
 
 /**
  * Macro to define any kind of motor command for duty width and velocity
  */
-#define MAKE_MOTOR_COMMAND(TYPE, ID, CMD) \
-	struct M ## TYPE ## ID: Command, md_base_t<ID> \
+#define MAKE_MOTOR_COMMAND(TYPE, ID, CMDTYPE) \
+	struct M ## TYPE ## ID: MotorCommand \
 	{ \
-		M ## TYPE ## ID(unsigned width) : md_base_t(width) {} \
-		\
-		const std::string toString() const override \
-		{ \
-			std::stringstream ss; \
-			ss << "!" << (CMD) << std::to_string(_id) << "=" << std::to_string(_width) << "\n"; \
-			return ss.str(); \
-		} \
+		M ## TYPE ## ID(int width) : MotorCommand(CMDTYPE, ID, width) {} \
 	};
 
 /*
@@ -311,28 +419,28 @@ private:
  */
 
 // commands::MDW0
-MAKE_MOTOR_COMMAND(DW,  0, "M")
+MAKE_MOTOR_COMMAND(DW,  0, DUTY_WIDTH)
 
 // commands::MDW1
-MAKE_MOTOR_COMMAND(DW,  1, "M")
+MAKE_MOTOR_COMMAND(DW,  1, DUTY_WIDTH)
 
 // commands::MDWD0
-MAKE_MOTOR_COMMAND(DWD, 0, "MD")
+MAKE_MOTOR_COMMAND(DWD, 0, DUTY_WIDTH_DECAY)
 
 // commands::MDWD1
-MAKE_MOTOR_COMMAND(DWD, 1, "MD")
+MAKE_MOTOR_COMMAND(DWD, 1, DUTY_WIDTH_DECAY)
 
 // commands::MV0
-MAKE_MOTOR_COMMAND(V,   0, "MV")
+MAKE_MOTOR_COMMAND(V,   0, VELOCITY)
 
 // commands::MV1
-MAKE_MOTOR_COMMAND(V,   1, "MV")
+MAKE_MOTOR_COMMAND(V,   1, VELOCITY)
 
 // commands::MVD0
-MAKE_MOTOR_COMMAND(VD,  0, "MVD")
+MAKE_MOTOR_COMMAND(VD,  0, VELOCITY_DECAY)
 
 // commands::MVD1
-MAKE_MOTOR_COMMAND(VD,  1, "MVD")
+MAKE_MOTOR_COMMAND(VD,  1, VELOCITY_DECAY)
 
 // finalize
 #undef MAKE_MOTOR_COMMAND
@@ -348,9 +456,10 @@ MAKE_MOTOR_COMMAND(VD,  1, "MVD")
  */
 struct Empty : Command
 {
-	const std::string toString() const override
+	size_t serialize(char *buf, size_t len) const override
 	{
-		return "\n";
+		if (len < COMMAND_MAX_LENGTH) return COMMAND_MAX_LENGTH;
+		return put_str(buf, "\n") - buf;
 	}
 };
 
@@ -358,22 +467,52 @@ struct Empty : Command
 
 
 
+/*
+ * write a command to a device. Commands are serialized into a buffer on the
+ * stack, only plain command strings that do not fit take a detour
+ */
+template <typename DEVICE, typename CMD>
+inline
+DEVICE* write_command(DEVICE *dev, const CMD &cmd)
+{
+	char buf[nst::commands::COMMAND_MAX_LENGTH];
+	size_t n = cmd.serialize(buf, sizeof(buf));
+	if (n <= sizeof(buf))
+		dev->write(buf, n);
+	else
+		dev->write(cmd.toString().c_str());
+	return dev;
+}
+
 inline
 QTcpSocket* operator<< (QTcpSocket* sock, const nst::commands::Command &cmd)
 {
-	sock->write(cmd.toString().c_str());
-	return sock;
+	return write_command(sock, cmd);
+}
+
+inline
+QTcpSocket* operator<< (QTcpSocket* sock, const nst::commands::MotorCommand &cmd)
+{
+	return write_command(sock, cmd);
 }
 
-// inline
-// QSo
 inline
 QSerialPort* operator<< (QSerialPort* serial, const nst::commands::Command &cmd)
 {
-	serial->write(cmd.toString().c_str());
-	return serial;
+	return write_command(serial, cmd);
+}
+
+inline
+QSerialPort* operator<< (QSerialPort* serial, const nst::commands::MotorCommand &cmd)
+{
+	return write_command(serial, cmd);
+}
+
+inline
+nst::LinuxSerialPort* operator<< (nst::LinuxSerialPort* serial, const nst::commands::Command &cmd)
+{
+	return write_command(serial, cmd);
 }
 
 
 #endif /* __COMMANDS_HPP__DE8555E9_1B8E_47A6_BF34_8AE88A27C9BE */
-
@@ -8,6 +8,7 @@
 #include <cstdint>
 #include <bitset>
 #include <memory>
+#include <vector>
 #include <QString>
 
 
@@ -18,6 +19,12 @@ class RobotControl;
 /**
  * struct DVSEvent - A single DVS event.
  *
+ * The timestamp t is in microseconds. The parser unwraps the 16, 24 or 32 bit
+ * timestamps of the retina, so t increases monotonically for the lifetime of
+ * a connection. Only events that were decoded while the parser was out of
+ * sync with the stream may be off (see BytestreamParser). Depending on the
+ * timestamp mode, t either counts from the first event of the connection,
+ * which has t = 0, or lives on the host's monotonic clock.
  */
 struct DVSEvent {
 	uint8_t id;
@@ -29,7 +36,13 @@ struct DVSEvent {
 		TIMEFORMAT_0BYTES,
 		TIMEFORMAT_2BYTES,
 		TIMEFORMAT_3BYTES,
+		TIMEFORMAT_4BYTES,
 	} timeformat_t;
+
+	typedef enum {
+		TIMESTAMP_DEVICE, // device time since the first event of the connection
+		TIMESTAMP_HOST,   // device time mapped onto the host's monotonic clock
+	} timestamp_mode_t;
 };
 
 /**
@@ -54,6 +67,25 @@ struct IMUEvent {
 	} sensoraxis_t;
 };
 
+/**
+ * struct IMUSample - A single reading of one of the IMU's sensors, i.e. the
+ * content of one "-S1x" response line of the robot
+ */
+struct IMUSample {
+	IMUEvent::sensortype_t type;
+	double v[3] = {0.0};
+};
+
+/**
+ * struct ChunkStamp - arrival time of a chunk of data from the robot, and the
+ * number of events that were decoded up to and including this chunk. Used to
+ * find out when a decoded event arrived
+ */
+struct ChunkStamp {
+	uint64_t t_read;
+	uint64_t seq;
+};
+
 /**
  * struct RPYEvent - A single estimate of RPY from all sensors.
  *
@@ -76,13 +108,31 @@ struct SensorEvent {
 
 
 /**
- * A user function
+ * struct UserFunctionBatch - everything a batch user function gets per call:
+ * a packet of events, and the sensor events that arrived since the last call.
+ * Either can be empty, both are empty on the periodic tick. The data is only
+ * valid during the call
+ */
+struct UserFunctionBatch {
+	const DVSEvent *events;
+	size_t nevents;
+	const SensorEvent *sensors;
+	size_t nsensors;
+};
+
+
+/**
+ * A user function. Either fn is called for every single event, sensor event
+ * and tick, or batch_fn is called once per packet. If both are set, batch_fn
+ * is used
  */
 struct UserFunction {
 	const char *name;
 	void (*fn)(RobotControl * const control,
 	           std::shared_ptr<DVSEvent> dvs_ev,
 		   std::shared_ptr<SensorEvent> sensor_ev);
+	void (*batch_fn)(RobotControl * const control,
+	                 const UserFunctionBatch &batch) = nullptr;
 };
 
 
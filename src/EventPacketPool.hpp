@@ -0,0 +1,72 @@
+#ifndef __EVENTPACKETPOOL_HPP__8E4B1F27_5C93_4D6A_B0E2_74A9C3D51F68
+#define __EVENTPACKETPOOL_HPP__8E4B1F27_5C93_4D6A_B0E2_74A9C3D51F68
+
+#include <cstddef>
+#include <memory>
+#include "Datatypes.hpp"
+#include "Pool.hpp"
+
+namespace nst {
+
+/**
+ * DVSEventPacket - A contiguous batch of DVS events that were decoded from
+ * the bytestream.
+ *
+ * Packets are handed out by an EventPacketPool and carry a single reference
+ * count, see DVSEventPacketPtr. The storage is allocated once with a fixed
+ * capacity and reused when the last reference is gone.
+ */
+class DVSEventPacket : public PoolItem<DVSEventPacket>
+{
+public:
+	typedef DVSEvent* iterator;
+	typedef const DVSEvent* const_iterator;
+
+	static constexpr size_t DEFAULT_CAPACITY = 4096;
+	static constexpr size_t DEFAULT_MAX_PACKETS = 64;
+
+	size_t size() const { return _size; }
+	size_t capacity() const { return _capacity; }
+	bool empty() const { return _size == 0; }
+
+	/*
+	 * set the number of valid events, at most capacity()
+	 */
+	void resize(size_t n) { _size = n < _capacity ? n : _capacity; }
+
+	DVSEvent* data() { return _events.get(); }
+	const DVSEvent* data() const { return _events.get(); }
+
+	DVSEvent& operator[](size_t i) { return _events[i]; }
+	const DVSEvent& operator[](size_t i) const { return _events[i]; }
+
+	iterator begin() { return data(); }
+	iterator end() { return data() + _size; }
+	const_iterator begin() const { return data(); }
+	const_iterator end() const { return data() + _size; }
+
+private:
+	friend class Pool<DVSEventPacket>;
+
+	explicit DVSEventPacket(size_t capacity)
+	: _capacity(capacity), _events(new DVSEvent[capacity])
+	{ }
+
+	void reset() { _size = 0; }
+
+	size_t _size = 0;
+	const size_t _capacity;
+	std::unique_ptr<DVSEvent[]> _events;
+};
+
+
+/*
+ * packets are recycled through a Pool, see there for the ownership rules
+ */
+typedef Pool<DVSEventPacket> EventPacketPool;
+typedef PoolPtr<DVSEventPacket> DVSEventPacketPtr;
+
+
+} // nst::
+
+#endif /* __EVENTPACKETPOOL_HPP__8E4B1F27_5C93_4D6A_B0E2_74A9C3D51F68 */
@@ -0,0 +1,129 @@
+#include "IOReactor.hpp"
+#include "utils.hpp"
+
+#include <QThread>
+#include <QString>
+#include <iostream>
+
+namespace nst {
+
+IOReactor::
+IOReactor()
+: _nio(DEFAULT_IO_THREADS)
+{
+	// leave cores for the GUI and the user functions
+	const unsigned cores = static_cast<unsigned>(QThread::idealThreadCount());
+	_nparse = clamp(cores / 2, 1u, static_cast<unsigned>(MAX_PARSE_THREADS));
+}
+
+
+IOReactor::
+~IOReactor()
+{
+	stop();
+}
+
+
+void IOReactor::
+setThreadCounts(unsigned io_threads, unsigned parse_threads)
+{
+	_nio = io_threads > 0 ? io_threads : 1;
+	_nparse = parse_threads > 0 ? parse_threads : 1;
+}
+
+
+unsigned IOReactor::
+ioThreads() const
+{
+	return _nio;
+}
+
+
+unsigned IOReactor::
+parseThreads() const
+{
+	return _nparse;
+}
+
+
+QThread* IOReactor::
+attachConnection()
+{
+	return attach(_io);
+}
+
+
+QThread* IOReactor::
+attachParser()
+{
+	return attach(_parse);
+}
+
+
+QThread* IOReactor::
+attach(std::vector<worker_t> &pool)
+{
+	if (_attached++ == 0) start();
+
+	worker_t *best = &pool[0];
+	for (auto &w: pool)
+		if (w.load < best->load) best = &w;
+	best->load++;
+	return best->thread;
+}
+
+
+void IOReactor::
+detach(QThread *thread)
+{
+	for (auto *pool: {&_io, &_parse}) {
+		for (auto &w: *pool) {
+			if (w.thread != thread) continue;
+			w.load--;
+			if (--_attached == 0) stop();
+			return;
+		}
+	}
+	std::cerr << "EE: Thread was not handed out by the reactor" << std::endl;
+}
+
+
+void IOReactor::
+start()
+{
+	for (unsigned i = 0; i < _nio; i++) {
+		auto *t = new QThread();
+		t->setObjectName(QString("pbrc-io-%1").arg(i));
+		_io.push_back({t, 0});
+	}
+	for (unsigned i = 0; i < _nparse; i++) {
+		auto *t = new QThread();
+		t->setObjectName(QString("pbrc-parse-%1").arg(i));
+		_parse.push_back({t, 0});
+	}
+
+	for (auto *pool: {&_io, &_parse})
+		for (auto &w: *pool)
+			w.thread->start();
+}
+
+
+void IOReactor::
+stop()
+{
+	// a finishing thread deletes the objects that were scheduled for
+	// deletion in it
+	for (auto *pool: {&_io, &_parse})
+		for (auto &w: *pool)
+			w.thread->quit();
+	for (auto *pool: {&_io, &_parse}) {
+		for (auto &w: *pool) {
+			w.thread->wait();
+			delete w.thread;
+		}
+		pool->clear();
+	}
+}
+
+
+} // nst::
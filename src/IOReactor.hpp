@@ -0,0 +1,83 @@
+#ifndef __IOREACTOR_HPP__A2C6E91D_7F35_4B08_9D4E_51B83F0C62A7
+#define __IOREACTOR_HPP__A2C6E91D_7F35_4B08_9D4E_51B83F0C62A7
+
+#include <vector>
+
+// forward declarations
+class QThread;
+
+namespace nst {
+
+/**
+ * IOReactor - the threads that serve the connections and parsers of all
+ * robots.
+ *
+ * Instead of two threads per robot, there is a fixed number of I/O threads
+ * and parse threads. Each connection and parser is moved into the least busy
+ * thread of its kind, whose event loop multiplexes all of them. The number of
+ * threads therefore does not depend on the number of robots.
+ *
+ * Objects that share a thread take turns: connections read and parsers decode
+ * a bounded amount of data at a time and then yield to the event loop (see
+ * PushbotConnection::READ_QUANTUM and BytestreamParser::PARSE_QUANTUM), so
+ * that a robot which floods its link can not starve the others.
+ *
+ * The threads are started with the first attached object and stopped when
+ * the last one was detached. Like RCManager, this is not thread-safe and
+ * meant to be used from the main thread.
+ */
+class IOReactor
+{
+public:
+	static constexpr unsigned DEFAULT_IO_THREADS = 2;
+	static constexpr unsigned MAX_PARSE_THREADS = 4;
+
+	IOReactor();
+	~IOReactor();
+
+	IOReactor(const IOReactor&) = delete;
+	IOReactor& operator=(const IOReactor&) = delete;
+
+	/*
+	 * number of threads of each kind. This takes effect the next time the
+	 * threads are started, i.e. while nothing is attached. The default for
+	 * parse threads depends on the number of cores
+	 */
+	void setThreadCounts(unsigned io_threads, unsigned parse_threads);
+	unsigned ioThreads() const;
+	unsigned parseThreads() const;
+
+	/*
+	 * the least busy thread for a connection or a parser
+	 */
+	QThread* attachConnection();
+	QThread* attachParser();
+
+	/*
+	 * give back a thread that was handed out by one of the attach
+	 * functions. Objects that were scheduled for deletion in it are gone
+	 * once the threads were stopped
+	 */
+	void detach(QThread *thread);
+
+private:
+	struct worker_t {
+		QThread *thread;
+		unsigned load;
+	};
+
+	QThread* attach(std::vector<worker_t> &pool);
+	void start();
+	void stop();
+
+	unsigned _nio;
+	unsigned _nparse;
+	std::vector<worker_t> _io;
+	std::vector<worker_t> _parse;
+	unsigned _attached = 0;
+};
+
+
+} // nst::
+
+#endif /* __IOREACTOR_HPP__A2C6E91D_7F35_4B08_9D4E_51B83F0C62A7 */
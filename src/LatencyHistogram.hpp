@@ -0,0 +1,140 @@
+#ifndef __LATENCYHISTOGRAM_HPP__6A0D3E92_C47B_4F15_8E2A_D93B1C5F7048
+#define __LATENCYHISTOGRAM_HPP__6A0D3E92_C47B_4F15_8E2A_D93B1C5F7048
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace nst {
+
+/**
+ * LatencyHistogram - histogram of latencies in microseconds with HDR-style
+ * log-linear buckets.
+ *
+ * Each power of two is divided into SUB_BUCKETS linear buckets, so that every
+ * value is reported with a relative error of less than 1/SUB_BUCKETS (about 6%)
+ * over the whole range from 1us to more than an hour. Recording is a single
+ * relaxed atomic increment, i.e. cheap enough for the hot path. One thread may
+ * record while others read. Reads are not a consistent snapshot, which does
+ * not matter for statistics.
+ */
+class LatencyHistogram
+{
+public:
+	static constexpr unsigned SUB_BITS = 4;
+	static constexpr unsigned SUB_BUCKETS = 1 << SUB_BITS;
+	static constexpr unsigned MAX_EXPONENT = 32;
+	static constexpr unsigned NBUCKETS = (MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS;
+
+	LatencyHistogram() { reset(); }
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+	void record(uint64_t us)
+	{
+		_buckets[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+		_count.fetch_add(1, std::memory_order_relaxed);
+		if (us > _max.load(std::memory_order_relaxed))
+			_max.store(us, std::memory_order_relaxed);
+	}
+
+	uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+	uint64_t max() const { return _max.load(std::memory_order_relaxed); }
+
+	/*
+	 * latency below which the fraction p (in [0,1]) of all samples lie.
+	 * Reports the upper bound of the bucket, i.e. never underestimates
+	 */
+	uint64_t percentile(double p) const
+	{
+		const uint64_t n = count();
+		if (n == 0) return 0;
+
+		uint64_t rank = static_cast<uint64_t>(p * n + 0.5);
+		if (rank < 1) rank = 1;
+		uint64_t seen = 0;
+		for (unsigned i = 0; i < NBUCKETS; i++) {
+			seen += _buckets[i].load(std::memory_order_relaxed);
+			if (seen >= rank && i < NBUCKETS - 1)
+				return upper(i) < max() ? upper(i) : max();
+		}
+		return max();
+	}
+
+	void reset()
+	{
+		for (auto &b: _buckets) b.store(0, std::memory_order_relaxed);
+		_count.store(0, std::memory_order_relaxed);
+		_max.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	/*
+	 * values below SUB_BUCKETS get a bucket of their own. Above, the
+	 * exponent selects a group of SUB_BUCKETS buckets, and the SUB_BITS bits
+	 * below the leading one select the bucket in that group
+	 */
+	static unsigned bucket(uint64_t v)
+	{
+		if (v < SUB_BUCKETS) return static_cast<unsigned>(v);
+
+		unsigned e = 63 - __builtin_clzll(v);
+		if (e > MAX_EXPONENT) return NBUCKETS - 1;
+		unsigned sub = static_cast<unsigned>(v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1);
+		return (e - SUB_BITS + 1) * SUB_BUCKETS + sub;
+	}
+
+	/*
+	 * largest value that goes into bucket i
+	 */
+	static uint64_t upper(unsigned i)
+	{
+		if (i < SUB_BUCKETS) return i;
+
+		unsigned e = i / SUB_BUCKETS + SUB_BITS - 1;
+		uint64_t sub = i % SUB_BUCKETS;
+		return ((SUB_BUCKETS + sub + 1) << (e - SUB_BITS)) - 1;
+	}
+
+	std::atomic<uint64_t> _buckets[NBUCKETS];
+	std::atomic<uint64_t> _count;
+	std::atomic<uint64_t> _max;
+};
+
+
+/**
+ * LatencyStats - latencies of one robot along the processing pipeline. All
+ * stages are measured from the moment a chunk of data was read from the
+ * socket or serial port, except for emergency stops
+ */
+struct LatencyStats
+{
+	// events of the chunk were decoded by the parser
+	LatencyHistogram decode;
+
+	// all events of the chunk arrived in RobotControl
+	LatencyHistogram deliver;
+
+	// the user function returned from the oldest event of a packet
+	LatencyHistogram userfn;
+
+	// a command that the user function issued was written to the robot
+	LatencyHistogram command;
+
+	// an emergency stop was written to the robot, measured from the request
+	LatencyHistogram stop;
+
+	void reset()
+	{
+		decode.reset();
+		deliver.reset();
+		userfn.reset();
+		command.reset();
+		stop.reset();
+	}
+};
+
+
+} // nst::
+
+#endif /* __LATENCYHISTOGRAM_HPP__6A0D3E92_C47B_4F15_8E2A_D93B1C5F7048 */
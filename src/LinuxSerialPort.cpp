@@ -0,0 +1,384 @@
+#include "LinuxSerialPort.hpp"
+#include "utils.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <memory>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#endif
+
+namespace nst {
+
+LinuxSerialPort::
+LinuxSerialPort(QObject *parent)
+: QObject(parent), _ring(RING_CAPACITY)
+{ }
+
+
+LinuxSerialPort::
+~LinuxSerialPort()
+{
+	close();
+}
+
+
+#ifdef __linux__
+
+bool LinuxSerialPort::
+open(const QString &path, int baudrate)
+{
+	close();
+
+	_fd = ::open(path.toLocal8Bit().constData(), O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+	if (_fd < 0) {
+		_error = QString::fromLocal8Bit(std::strerror(errno));
+		return false;
+	}
+	if (!configure(baudrate)) {
+		_error = QString::fromLocal8Bit(std::strerror(errno));
+		::close(_fd);
+		_fd = -1;
+		return false;
+	}
+
+	_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (_wake_fd < 0) {
+		_error = QString::fromLocal8Bit(std::strerror(errno));
+		::close(_fd);
+		_fd = -1;
+		return false;
+	}
+
+	_error.clear();
+	_wakeup_pending.store(false);
+	_stop.store(false);
+	_reader = std::thread(&LinuxSerialPort::readLoop, this);
+	return true;
+}
+
+
+bool LinuxSerialPort::
+configure(int baudrate)
+{
+	// raw 8N1 without flow control, the same that QSerialPort uses by
+	// default. termios2 takes the baudrate as a plain number
+	struct termios2 tio;
+	if (ioctl(_fd, TCGETS2, &tio) < 0) return false;
+
+	tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF | IXANY);
+	tio.c_oflag &= ~OPOST;
+	tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS | CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= CS8 | CLOCAL | CREAD | BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = baudrate;
+	tio.c_ospeed = baudrate;
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	if (ioctl(_fd, TCSETS2, &tio) < 0) return false;
+
+	// tell the driver to hand out data right away instead of waiting for
+	// its latency timer. not all drivers (or ptys) support this
+	struct serial_struct ser;
+	if (ioctl(_fd, TIOCGSERIAL, &ser) == 0) {
+		ser.flags |= ASYNC_LOW_LATENCY;
+		ioctl(_fd, TIOCSSERIAL, &ser);
+	}
+
+	ioctl(_fd, TCFLSH, TCIOFLUSH);
+	return true;
+}
+
+
+void LinuxSerialPort::
+close()
+{
+	if (_fd < 0) return;
+
+	if (_reader.joinable()) {
+		_stop.store(true);
+		uint64_t one = 1;
+		if (::write(_wake_fd, &one, sizeof(one)) < 0)
+			std::cerr << "EE: Could not stop the serial reader" << std::endl;
+		_reader.join();
+	}
+	::close(_wake_fd);
+	::close(_fd);
+	_wake_fd = -1;
+	_fd = -1;
+
+	{
+		QMutexLocker lock(&_write_mutex);
+		_write_buf.clear();
+		_write_backlog.store(0, std::memory_order_relaxed);
+	}
+
+	// whatever was not picked up is gone
+	std::unique_ptr<char[]> sink(new char[READ_SIZE]);
+	while (_ring.pop(sink.get(), READ_SIZE) > 0) ;
+}
+
+
+void LinuxSerialPort::
+readLoop()
+{
+	std::unique_ptr<char[]> buf(new char[READ_SIZE]);
+	struct pollfd fds[2] = {
+		{_fd, POLLIN, 0},
+		{_wake_fd, POLLIN, 0},
+	};
+
+	for (;;) {
+		// the device is writable most of the time, so only ask for it
+		// while there is something to write
+		fds[0].events = POLLIN;
+		if (_write_backlog.load(std::memory_order_relaxed) > 0)
+			fds[0].events |= POLLOUT;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			emit error(QString::fromLocal8Bit(std::strerror(errno)));
+			return;
+		}
+		if (fds[1].revents) {
+			uint64_t count;
+			if (::read(_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+				emit error(QString::fromLocal8Bit(std::strerror(errno)));
+				return;
+			}
+			if (_stop.load()) return;
+		}
+		if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			emit error(QString("Device closed"));
+			return;
+		}
+
+		if (fds[0].revents & POLLOUT) {
+			qint64 n;
+			int err;
+			{
+				QMutexLocker lock(&_write_mutex);
+				n = writeBuffered();
+				err = errno;
+			}
+			if (n < 0) {
+				emit error(QString::fromLocal8Bit(std::strerror(err)));
+				return;
+			}
+			if (n > 0) emit bytesWritten(n);
+		}
+		if (!(fds[0].revents & POLLIN)) continue;
+
+		// don't read more than fits. the consumer frees space while we
+		// wait, and the device keeps the rest meanwhile
+		const size_t space = _ring.capacity() - _ring.size();
+		if (space == 0) {
+			poll(&fds[1], 1, 1);
+			continue;
+		}
+
+		ssize_t n = ::read(_fd, buf.get(), space < READ_SIZE ? space : READ_SIZE);
+		const uint64_t t_read = monotonic_us();
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			emit error(QString::fromLocal8Bit(std::strerror(errno)));
+			return;
+		}
+		if (n == 0) {
+			emit error(QString("Device closed"));
+			return;
+		}
+
+		_ring.push(buf.get(), static_cast<size_t>(n));
+		if (!_wakeup_pending.exchange(true)) {
+			_t_pending.store(t_read, std::memory_order_relaxed);
+			emit readyRead();
+		}
+	}
+}
+
+
+qint64 LinuxSerialPort::
+write(const char *data, qint64 len)
+{
+	if (_fd < 0) return -1;
+
+	qint64 written = 0;
+	bool failed = false;
+	bool wake = false;
+	{
+		QMutexLocker lock(&_write_mutex);
+
+		// nothing may overtake data that is still buffered
+		if (_write_buf.empty()) {
+			while (written < len) {
+				ssize_t n = ::write(_fd, data + written, static_cast<size_t>(len - written));
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					if (errno != EAGAIN) {
+						_error = QString::fromLocal8Bit(std::strerror(errno));
+						failed = true;
+					}
+					break;
+				}
+				written += n;
+			}
+		}
+
+		// the reader flushes the rest once the device is writable
+		if (!failed && written < len) {
+			wake = _write_buf.empty();
+			_write_buf.insert(_write_buf.end(), data + written, data + len);
+			_write_backlog.store(static_cast<qint64>(_write_buf.size()), std::memory_order_relaxed);
+		}
+	}
+
+	if (wake) {
+		uint64_t one = 1;
+		if (::write(_wake_fd, &one, sizeof(one)) < 0)
+			std::cerr << "EE: Could not wake up the serial reader" << std::endl;
+	}
+	if (written > 0) emit bytesWritten(written);
+	if (failed) return written > 0 ? written : -1;
+	return len;
+}
+
+
+/*
+ * write as much of the write buffer as the device takes without blocking.
+ * The caller holds _write_mutex. Returns the number of bytes written, or -1
+ * with errno set if the device failed
+ */
+qint64 LinuxSerialPort::
+writeBuffered()
+{
+	size_t written = 0;
+	while (written < _write_buf.size()) {
+		ssize_t n = ::write(_fd, _write_buf.data() + written, _write_buf.size() - written);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) break;
+			return -1;
+		}
+		written += static_cast<size_t>(n);
+	}
+	_write_buf.erase(_write_buf.begin(), _write_buf.begin() + written);
+	_write_backlog.store(static_cast<qint64>(_write_buf.size()), std::memory_order_relaxed);
+	return static_cast<qint64>(written);
+}
+
+#else
+
+bool LinuxSerialPort::
+open(const QString & /*path*/, int /*baudrate*/)
+{
+	_error = "The native serial backend is only available on Linux";
+	return false;
+}
+
+bool LinuxSerialPort::configure(int /*baudrate*/) { return false; }
+void LinuxSerialPort::close() { }
+void LinuxSerialPort::readLoop() { }
+qint64 LinuxSerialPort::write(const char * /*data*/, qint64 /*len*/) { return -1; }
+qint64 LinuxSerialPort::writeBuffered() { return -1; }
+
+#endif
+
+
+bool LinuxSerialPort::
+isOpen() const
+{
+	return _fd >= 0;
+}
+
+
+QString LinuxSerialPort::
+errorString() const
+{
+	return _error;
+}
+
+
+QByteArray LinuxSerialPort::
+readAll(uint64_t *t_read)
+{
+	return read(static_cast<qint64>(_ring.size()), t_read);
+}
+
+
+QByteArray LinuxSerialPort::
+read(qint64 maxlen, uint64_t *t_read)
+{
+	const qint64 available = static_cast<qint64>(_ring.size());
+	QByteArray data(static_cast<int>(available < maxlen ? available : maxlen), Qt::Uninitialized);
+	data.resize(static_cast<int>(read(data.data(), data.size(), t_read)));
+	return data;
+}
+
+
+qint64 LinuxSerialPort::
+read(char *data, qint64 maxlen, uint64_t *t_read)
+{
+	// acknowledge first, so that the reader wakes us up again if it pushes
+	// while we drain the buffer
+	_wakeup_pending.store(false);
+	if (t_read) *t_read = _t_pending.load(std::memory_order_relaxed);
+
+	return static_cast<qint64>(_ring.pop(data, static_cast<size_t>(maxlen)));
+}
+
+
+qint64 LinuxSerialPort::
+bytesAvailable() const
+{
+	return static_cast<qint64>(_ring.size());
+}
+
+
+qint64 LinuxSerialPort::
+write(const char *data)
+{
+	return write(data, std::strlen(data));
+}
+
+
+qint64 LinuxSerialPort::
+write(const QByteArray &data)
+{
+	return write(data.constData(), data.size());
+}
+
+
+bool LinuxSerialPort::
+flush()
+{
+	// hand the device what it takes now, the reader writes the rest
+	// later. Like QSerialPort, this never blocks
+	if (_fd < 0) return false;
+
+	qint64 n;
+	{
+		QMutexLocker lock(&_write_mutex);
+		n = writeBuffered();
+	}
+	if (n > 0) emit bytesWritten(n);
+	return n > 0;
+}
+
+
+qint64 LinuxSerialPort::
+bytesToWrite() const
+{
+	return _write_backlog.load(std::memory_order_relaxed);
+}
+
+
+} // nst::
@@ -0,0 +1,109 @@
+#ifndef __LINUXSERIALPORT_HPP__F3B8D2A6_41C7_4E95_8A0B_C6E2719D54F1
+#define __LINUXSERIALPORT_HPP__F3B8D2A6_41C7_4E95_8A0B_C6E2719D54F1
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include "SPSCQueue.hpp"
+
+namespace nst {
+
+/**
+ * LinuxSerialPort - serial port that talks to the tty directly, as an
+ * alternative to QSerialPort for fast links such as the 12 Mbaud FTDI
+ * adapters of the PushBots.
+ *
+ * The port is configured raw via termios2, which allows arbitrary baudrates,
+ * and the driver is asked for low latency where it supports it. A reader
+ * thread blocks in poll() and moves everything it reads into a preallocated
+ * ring buffer. The owner's thread gets a readyRead() as soon as the buffer
+ * holds data, and only one of them is pending at any time. readAll() drains
+ * the buffer and acknowledges the wakeup, the same scheme as for the parser.
+ *
+ * The device is non-blocking. write() hands the device as much as it takes
+ * right away and keeps the rest in a write buffer, which the reader thread
+ * flushes when the device is writable again. A stalled adapter therefore
+ * never blocks the owner's thread, and bytesToWrite() tells how far the
+ * device lags behind.
+ *
+ * Only available on Linux. Elsewhere open() fails.
+ */
+class LinuxSerialPort : public QObject
+{
+	Q_OBJECT
+
+public:
+	static constexpr size_t RING_CAPACITY = 1 << 20;
+	static constexpr size_t READ_SIZE = 1 << 16;
+
+	LinuxSerialPort(QObject *parent = 0);
+	virtual ~LinuxSerialPort();
+
+	bool open(const QString &path, int baudrate);
+	void close();
+	bool isOpen() const;
+	QString errorString() const;
+
+	/*
+	 * take all data that was read so far. t_read receives the time
+	 * (monotonic_us) at which the oldest of it was read from the device
+	 */
+	QByteArray readAll(uint64_t *t_read = nullptr);
+	QByteArray read(qint64 maxlen, uint64_t *t_read = nullptr);
+	qint64 read(char *data, qint64 maxlen, uint64_t *t_read = nullptr);
+	qint64 bytesAvailable() const;
+
+	qint64 write(const char *data, qint64 len);
+	qint64 write(const char *data);
+	qint64 write(const QByteArray &data);
+	bool flush();
+	qint64 bytesToWrite() const;
+
+signals:
+	void readyRead();
+
+	/*
+	 * emitted by write() in the caller's thread for the part that the
+	 * device took right away, and by the reader thread for the buffered
+	 * rest
+	 */
+	void bytesWritten(qint64 bytes);
+
+	/*
+	 * the device failed, e.g. because it was unplugged. The reader thread
+	 * has stopped, the port needs to be closed
+	 */
+	void error(const QString &msg);
+
+private:
+	void readLoop();
+	bool configure(int baudrate);
+	qint64 writeBuffered();
+
+	int _fd = -1;
+	QString _error;
+
+	// wakes the reader up when the port gets closed or data was buffered
+	int _wake_fd = -1;
+	std::atomic<bool> _stop{false};
+
+	// data that the device did not take yet, guarded by _write_mutex
+	QMutex _write_mutex;
+	std::vector<char> _write_buf;
+	std::atomic<qint64> _write_backlog{0};
+
+	std::thread _reader;
+	SPSCQueue<char> _ring;
+	std::atomic<bool> _wakeup_pending{false};
+	std::atomic<uint64_t> _t_pending{0};
+};
+
+
+} // nst::
+
+#endif /* __LINUXSERIALPORT_HPP__F3B8D2A6_41C7_4E95_8A0B_C6E2719D54F1 */
@@ -0,0 +1,209 @@
+#ifndef __POOL_HPP__5C8E2A61_D47F_4B39_9E06_A1F3B8D2C745
+#define __POOL_HPP__5C8E2A61_D47F_4B39_9E06_A1F3B8D2C745
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <QMutex>
+#include <QMutexLocker>
+
+namespace nst {
+
+// forward declarations
+template <typename T> class Pool;
+template <typename T> class PoolPtr;
+
+
+/**
+ * PoolItem - base of all objects that are handed out by a Pool<T>, where T is
+ * the derived class. It carries the single reference count of the object and
+ * the pool that it returns to.
+ *
+ * T needs a constructor T(size_t capacity) and a reset() that empties it
+ * before it is handed out again. Both are usually private, with Pool<T> as a
+ * friend.
+ */
+template <typename T>
+class PoolItem
+{
+protected:
+	PoolItem() { }
+	PoolItem(const PoolItem&) = delete;
+	PoolItem& operator=(const PoolItem&) = delete;
+
+private:
+	friend class Pool<T>;
+	friend class PoolPtr<T>;
+
+	std::atomic<uint32_t> _refs{0};
+	Pool<T> *_pool = nullptr;
+};
+
+
+/**
+ * Pool - recycles objects of a fixed capacity, so that a steady stream of
+ * data does not allocate memory.
+ *
+ * At most max_items objects exist at any time. When all of them are in use,
+ * acquire() fails and the caller is expected to try again later, i.e. a slow
+ * consumer leads to back pressure instead of growing memory.
+ *
+ * The pool is reference counted itself. The owner calls release() instead of
+ * deleting it, and the pool goes away once the last object came back. Objects
+ * can therefore outlive the object that created the pool. acquire() and
+ * release() are meant for one owner thread, objects may be returned from any
+ * thread.
+ */
+template <typename T>
+class Pool
+{
+public:
+	static Pool* create(size_t item_capacity, size_t max_items)
+	{
+		return new Pool(item_capacity, max_items);
+	}
+
+	Pool(const Pool&) = delete;
+	Pool& operator=(const Pool&) = delete;
+
+	/*
+	 * get an empty object. Returns a null pointer if all objects are in use
+	 */
+	PoolPtr<T> acquire()
+	{
+		T *item = nullptr;
+		{
+			QMutexLocker lock(&_mutex);
+			if (!_free.empty()) {
+				item = _free.back();
+				_free.pop_back();
+			}
+			else if (_allocated < _max_items) {
+				item = new T(_item_capacity);
+				item->_pool = this;
+				_allocated++;
+			}
+		}
+
+		if (!item) {
+			_exhausted.fetch_add(1, std::memory_order_relaxed);
+			return PoolPtr<T>();
+		}
+
+		_refs.fetch_add(1, std::memory_order_relaxed);
+		item->reset();
+		return PoolPtr<T>(item);
+	}
+
+	/*
+	 * give up the owner's reference
+	 */
+	void release() { unref(); }
+
+	size_t itemCapacity() const { return _item_capacity; }
+	size_t maxItems() const { return _max_items; }
+
+	/*
+	 * number of times acquire() failed
+	 */
+	uint64_t exhausted() const { return _exhausted.load(std::memory_order_relaxed); }
+
+private:
+	friend class PoolPtr<T>;
+
+	Pool(size_t item_capacity, size_t max_items)
+	: _item_capacity(item_capacity), _max_items(max_items)
+	{
+		_free.reserve(max_items);
+	}
+
+	~Pool()
+	{
+		// all objects came back, otherwise we would not be here
+		for (auto *item: _free)
+			delete item;
+	}
+
+	void recycle(T *item)
+	{
+		{
+			QMutexLocker lock(&_mutex);
+			_free.push_back(item);
+		}
+		unref();
+	}
+
+	void unref()
+	{
+		if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+
+	const size_t _item_capacity;
+	const size_t _max_items;
+
+	// one reference of the owner and one of each object in use
+	std::atomic<size_t> _refs{1};
+	std::atomic<uint64_t> _exhausted{0};
+
+	QMutex _mutex;
+	std::vector<T*> _free;
+	size_t _allocated = 0;
+};
+
+
+/**
+ * PoolPtr - shared reference to a pooled object. Copying costs one atomic
+ * increment, the object returns to its pool with the last reference.
+ */
+template <typename T>
+class PoolPtr
+{
+public:
+	PoolPtr() { }
+	PoolPtr(std::nullptr_t) { }
+
+	explicit PoolPtr(T *p) : _p(p)
+	{
+		if (_p) item()->_refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	PoolPtr(const PoolPtr &other) : PoolPtr(other._p) { }
+
+	PoolPtr(PoolPtr &&other) : _p(other._p)
+	{
+		other._p = nullptr;
+	}
+
+	~PoolPtr() { reset(); }
+
+	PoolPtr& operator=(PoolPtr other)
+	{
+		std::swap(_p, other._p);
+		return *this;
+	}
+
+	void reset()
+	{
+		if (_p && item()->_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			item()->_pool->recycle(_p);
+		_p = nullptr;
+	}
+
+	T* get() const { return _p; }
+	T* operator->() const { return _p; }
+	T& operator*() const { return *_p; }
+	explicit operator bool() const { return _p != nullptr; }
+
+private:
+	PoolItem<T>* item() const { return _p; }
+
+	T *_p = nullptr;
+};
+
+
+} // nst::
+
+#endif /* __POOL_HPP__5C8E2A61_D47F_4B39_9E06_A1F3B8D2C745 */
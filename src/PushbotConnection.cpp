@@ -1,23 +1,45 @@
 #include "PushbotConnection.hpp"
 #include "Commands.hpp"
+#include "StreamRecording.hpp"
+#include "LinuxSerialPort.hpp"
 #include <QMutexLocker>
 #include <QCoreApplication>
+#include <QTimer>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include "utils.hpp"
 
 namespace nst {
 
+const QEvent::Type PushbotConnection::STOP_EVENT = static_cast<QEvent::Type>(QEvent::registerEventType());
+
 
 PushbotConnection::
 PushbotConnection(QObject *parent)
 : QObject(parent)
 {
-
+	_buffers = ReceiveBufferPool::create(READ_QUANTUM, ReceiveBuffer::DEFAULT_MAX_BUFFERS);
+
+	// children move along into the connection's thread
+	_reconnect_timer = new QTimer(this);
+	_reconnect_timer->setSingleShot(true);
+	QObject::connect(_reconnect_timer, &QTimer::timeout, this, &PushbotConnection::_reconnect_timeout);
+	_connect_timer = new QTimer(this);
+	_connect_timer->setSingleShot(true);
+	QObject::connect(_connect_timer, &QTimer::timeout, this, &PushbotConnection::_connect_timeout);
+
+	for (unsigned i = 0; i < NMOTORS; i++) {
+		_motor_target[i].store(0);
+		_motor_origin[i].store(0);
+	}
 }
 
 PushbotConnection::
 ~PushbotConnection()
-{ }
+{
+	_buffers->release();
+}
 
 
 void PushbotConnection::
@@ -28,45 +50,102 @@ connect(const QString uri, uint16_t port)
 		QMetaObject::invokeMethod(this, "connect", Qt::QueuedConnection, Q_ARG(const QString, uri), Q_ARG(uint16_t, port));
 		return;
 	}
-	auto uri_lower = uri.toLower();
 
-	// if we already have a socket connection, re-establish the socket first
-	if (this->_sock || this->_serial) disconnect();
+	// start over, also if a reconnect is still pending. The device of
+	// the previous connect() must not stay around next to the new one
+	_reconnect_timer->stop();
+	_connect_timer->stop();
+	_reconnecting.store(false);
+	closeDevice();
+
+	_uri = uri;
+	_port = port;
+	_reconnect = true;
+	_reconnect_attempts = 0;
+	openDevice();
+}
+
+
+void PushbotConnection::
+openDevice()
+{
+	auto uri_lower = _uri.toLower();
+
+	// the robot starts over, so nothing was written to it yet, and the
+	// parser shall not continue where the previous stream stopped
+	for (unsigned i = 0; i < NMOTORS; i++)
+		_motor_written[i] = 0;
+	_motor_deferred = false;
+	_stop_latched.store(false);
+	_stream_start = true;
 
 	// figure out the type of the connection
 	this->_ctype = DVS_NETWORK_DEVICE;
 	int rate_idx = uri_lower.indexOf("baudrate");
 	if (rate_idx > 0) this->_ctype = DVS_SERIAL_DEVICE;
+	int replay_idx = uri_lower.indexOf("?replay=");
+	if (replay_idx > 0) this->_ctype = DVS_REPLAY_DEVICE;
 
 	switch (_ctype) {
 	case DVS_NETWORK_DEVICE:
 		this->_sock = new QTcpSocket(this);
+		// a parser that falls behind throttles the robot through TCP
+		// instead of growing this buffer
+		this->_sock->setReadBufferSize(SOCKET_READ_BUFFER);
 		QObject::connect(_sock, &QTcpSocket::connected, this, &PushbotConnection::_sock_connected);
 		QObject::connect(_sock, &QTcpSocket::disconnected, this, &PushbotConnection::_sock_disconnected);
+		QObject::connect(_sock, static_cast<void (QAbstractSocket::*)(QAbstractSocket::SocketError)>(&QAbstractSocket::error), this, &PushbotConnection::_sock_error);
 		QObject::connect(_sock, &QTcpSocket::stateChanged, this, &PushbotConnection::_sock_onStateChanged);
 		QObject::connect(_sock, &QTcpSocket::readyRead, this, &PushbotConnection::_conn_readyRead);
-		this->_sock->connectToHost(uri, port);
+		QObject::connect(_sock, &QTcpSocket::bytesWritten, this, &PushbotConnection::_conn_bytesWritten);
+		this->_sock->connectToHost(_uri, _port);
+		_connect_timer->start(CONNECT_TIMEOUT_MS);
 		break;
 
 	case DVS_SERIAL_DEVICE: {
+		// options follow the baudrate, separated by '&'
+		QString portname = _uri.left(rate_idx - 1);
+		QStringList options = uri_lower.mid(rate_idx).split('&');
+		int baudrate = options[0].mid(9).toInt();
+		if (options.contains("native=1")) {
+			this->_native = new LinuxSerialPort(this);
+			QObject::connect(_native, &LinuxSerialPort::readyRead, this, &PushbotConnection::_conn_readyRead);
+			QObject::connect(_native, &LinuxSerialPort::bytesWritten, this, &PushbotConnection::_conn_bytesWritten);
+			QObject::connect(_native, &LinuxSerialPort::error, this, &PushbotConnection::_native_error);
+			if (this->_native->open(portname, baudrate))
+				setLinkUp(true);
+			else
+				linkLost(_native->errorString());
+			break;
+		}
+
 		this->_serial = new QSerialPort(this);
-		QString portname = uri.left(rate_idx - 1);
-		QString baudratestr = uri.right(uri.length() - portname.length() - 10);
-		int baudrate = baudratestr.toInt();
 		this->_serial->setPortName(portname);
 		this->_serial->setBaudRate(baudrate);
+		if (!this->_serial->open(QIODevice::ReadWrite)) {
+			linkLost(_serial->errorString());
+			break;
+		}
 
+		// errors are only of interest once the port is open
 		QObject::connect(_serial, &QSerialPort::readyRead, this, &PushbotConnection::_conn_readyRead);
+		QObject::connect(_serial, &QSerialPort::bytesWritten, this, &PushbotConnection::_conn_bytesWritten);
 		QObject::connect(_serial, static_cast<void (QSerialPort::*)(QSerialPort::SerialPortError)>(&QSerialPort::error), this, &PushbotConnection::_serial_error);
-		if (this->_serial->open(QIODevice::ReadWrite))
-			emit connected();
-		else {
-			// TODO: proper handling
-			std::cout << "NO CONNECTION TO SERIAL DEVICE!" << std::endl;
-		}
+		setLinkUp(true);
 		break;
 		}
 
+	case DVS_REPLAY_DEVICE:
+		this->_replayer = new StreamReplayer(this);
+		this->_replayer->setSpeed(_uri.mid(replay_idx + 8).toDouble());
+		QObject::connect(_replayer, &StreamReplayer::dataReady, this, &PushbotConnection::_replay_data);
+		QObject::connect(_replayer, &StreamReplayer::finished, this, &PushbotConnection::disconnect);
+		if (this->_replayer->open(_uri.left(replay_idx))) {
+			setLinkUp(true);
+			this->_replayer->start();
+		}
+		break;
+
 	case DVS_UNKNOWN_DEVICE:
 		break;
 	}
@@ -89,8 +168,10 @@ flush()
 
 	case DVS_SERIAL_DEVICE:
 		if (_serial) _serial->flush();
+		if (_native) _native->flush();
 		break;
 
+	case DVS_REPLAY_DEVICE:
 	case DVS_UNKNOWN_DEVICE:
 		break;
 	}
@@ -105,19 +186,61 @@ disconnect()
 		QMetaObject::invokeMethod(this, "disconnect", Qt::QueuedConnection);
 		return;
 	}
+
+	// the connection is meant to end, don't bring it back
+	_reconnect = false;
+	_reconnect_timer->stop();
+	closeDevice();
+
+	// the link was down already. Tell everyone that it is not coming back
+	if (_reconnecting.exchange(false))
+		emit disconnected();
+}
+
+
+bool PushbotConnection::
+isReconnecting() const
+{
+	return _reconnecting.load();
+}
+
+
+void PushbotConnection::
+closeDevice()
+{
+	// the last motor targets are usually meant to stop the robot. They
+	// are dropped if an emergency stop is latched
+	writeMotorTargets(true);
+
+	// this may be called from a signal of the device, which therefore is
+	// deleted later. It must not call back into this object any longer
 	switch (_ctype) {
 	case DVS_NETWORK_DEVICE:
 		if (_sock) {
+			QObject::disconnect(_sock, nullptr, this, nullptr);
 			_sock->disconnectFromHost();
-			delete this->_sock;
+			_sock->deleteLater();
 		}
 		break;
 
 	case DVS_SERIAL_DEVICE:
 		if (_serial) {
+			QObject::disconnect(_serial, nullptr, this, nullptr);
 			_serial->close();
-			delete this->_serial;
-			emit disconnected();
+			_serial->deleteLater();
+		}
+		if (_native) {
+			QObject::disconnect(_native, nullptr, this, nullptr);
+			_native->close();
+			_native->deleteLater();
+		}
+		break;
+
+	case DVS_REPLAY_DEVICE:
+		if (_replayer) {
+			// the replayer might be the sender of finished()
+			_replayer->stop();
+			_replayer->deleteLater();
 		}
 		break;
 
@@ -127,45 +250,206 @@ disconnect()
 
 	this->_sock = nullptr;
 	this->_serial = nullptr;
+	this->_native = nullptr;
+	this->_replayer = nullptr;
+	_replay_rest.clear();
+	_connect_timer->stop();
+	setLinkUp(false);
 }
 
 
 void PushbotConnection::
-_conn_readyRead()
+setLinkUp(bool up)
 {
-	switch (_ctype) {
-	case DVS_NETWORK_DEVICE:
-		if (_sock) {
-			auto data = _sock->readAll();
-			emit dataReady(std::move(data));
-		}
-		break;
+	if (up) _reconnecting.store(false);
+	if (up == _link_up) return;
+	_link_up = up;
+	if (up)
+		emit connected();
+	else
+		emit disconnected();
+}
 
-	case DVS_SERIAL_DEVICE:
-		if (_serial) {
-			auto data = _serial->readAll();
-			emit dataReady(std::move(data));
-		}
-		break;
 
-	case DVS_UNKNOWN_DEVICE:
-		break;
+void PushbotConnection::
+linkLost(const QString &reason)
+{
+	// nothing to do after an intentional disconnect, or if the device is
+	// gone already
+	if (!_reconnect || _reconnect_timer->isActive()) return;
+
+	// back off exponentially, a robot that is switched off shall not keep
+	// the thread busy. The timer runs before the device is closed, so that
+	// errors while closing it end up right above
+	const unsigned shift = _reconnect_attempts < 6 ? _reconnect_attempts : 6;
+	int delay = RECONNECT_MIN_MS << shift;
+	if (delay > RECONNECT_MAX_MS) delay = RECONNECT_MAX_MS;
+	_reconnect_timer->start(delay);
+	_reconnecting.store(true);
+
+	std::cerr << "EE: Connection to " << _uri.toStdString() << " failed: " << reason.toStdString() << std::endl;
+	closeDevice();
+	std::cout << "II: Reconnecting to " << _uri.toStdString() << " in " << delay << " ms" << std::endl;
+	emit reconnecting();
+}
+
+
+void PushbotConnection::
+_reconnect_timeout()
+{
+	_reconnect_attempts++;
+	openDevice();
+}
+
+
+void PushbotConnection::
+_connect_timeout()
+{
+	linkLost("Timeout while connecting");
+}
+
+
+void PushbotConnection::
+startRecording(const QString path)
+{
+	if (thread() != QThread::currentThread()) {
+		QMetaObject::invokeMethod(this, "startRecording", Qt::QueuedConnection, Q_ARG(const QString, path));
+		return;
+	}
+
+	auto recorder = make_unique<StreamRecorder>();
+	if (recorder->open(path))
+		_recorder = std::move(recorder);
+}
+
+
+void PushbotConnection::
+stopRecording()
+{
+	if (thread() != QThread::currentThread()) {
+		QMetaObject::invokeMethod(this, "stopRecording", Qt::QueuedConnection);
+		return;
+	}
+	_recorder.reset();
+}
+
+
+void PushbotConnection::
+_conn_readyRead()
+{
+	_read_posted = false;
+
+	// data of a recording that did not fit into the buffers before
+	if (_ctype == DVS_REPLAY_DEVICE) {
+		if (_replay_rest.isEmpty()) return;
+		QByteArray rest;
+		std::swap(rest, _replay_rest);
+		_replay_data(rest);
+		if (_replay_rest.isEmpty() && _replayer) _replayer->resume();
+		return;
 	}
+
+	qint64 available = 0;
+	if (_sock) available = _sock->bytesAvailable();
+	if (_serial) available = _serial->bytesAvailable();
+	if (_native) available = _native->bytesAvailable();
+	if (available <= 0) return;
+
+	// the parser still holds all buffers. leave the data where it is until
+	// it caught up
+	auto buf = _buffers->acquire();
+	if (!buf) {
+		scheduleRead(RETRY_INTERVAL_MS);
+		return;
+	}
+
+	// read at most one buffer at a time, the other connections of this
+	// thread get their turn before the rest. This is the one copy of the
+	// data, out of the device's own read buffer
+	uint64_t t_read = monotonic_us();
+	qint64 n = 0;
+	if (_sock) n = _sock->read(buf->data(), buf->capacity());
+	if (_serial) n = _serial->read(buf->data(), buf->capacity());
+	// stamped by the reader thread when the data came in
+	if (_native) n = _native->read(buf->data(), buf->capacity(), &t_read);
+	if (n <= 0) return;
+
+	if (n < available) scheduleRead(0);
+
+	// the link works, the next loss starts over with a short delay
+	_reconnect_attempts = 0;
+
+	buf->resize(n);
+	buf->setReadTime(t_read);
+	buf->setStreamStart(_stream_start);
+	_stream_start = false;
+	if (_metrics) RobotMetrics::add(_metrics->bytes_received, n);
+	if (_recorder) _recorder->record(buf->data(), buf->size(), t_read);
+	emit dataReady(buf);
+}
+
+
+void PushbotConnection::
+scheduleRead(int delay_ms)
+{
+	if (_read_posted) return;
+	_read_posted = true;
+	if (delay_ms > 0)
+		QTimer::singleShot(delay_ms, this, &PushbotConnection::_conn_readyRead);
+	else
+		QMetaObject::invokeMethod(this, "_conn_readyRead", Qt::QueuedConnection);
 }
 
 
+void PushbotConnection::
+_replay_data(const QByteArray &data)
+{
+	// chunks of a recording may be larger than a buffer
+	const uint64_t t_read = monotonic_us();
+	const char *p = data.constData();
+	qint64 left = data.size();
+	while (left > 0) {
+		auto buf = _buffers->acquire();
+		if (!buf) {
+			// hold the replay back until the parser caught up. data
+			// refers to the replayer's mapping, keep a copy
+			_replay_rest = QByteArray(p, static_cast<int>(left));
+			if (_replayer) _replayer->pause();
+			scheduleRead(RETRY_INTERVAL_MS);
+			return;
+		}
+
+		const size_t n = std::min(static_cast<size_t>(left), buf->capacity());
+		std::memcpy(buf->data(), p, n);
+		buf->resize(n);
+		buf->setReadTime(t_read);
+		buf->setStreamStart(_stream_start);
+		_stream_start = false;
+		if (_metrics) RobotMetrics::add(_metrics->bytes_received, n);
+		emit dataReady(buf);
+		p += n;
+		left -= n;
+	}
+}
 
 
 void PushbotConnection::
 _sock_connected()
 {
-	emit connected();
+	_connect_timer->stop();
+	setLinkUp(true);
 }
 
 void PushbotConnection::
 _sock_disconnected()
 {
-	emit disconnected();
+	linkLost("Connection closed by the robot");
+}
+
+void PushbotConnection::
+_sock_error(QAbstractSocket::SocketError /*error*/)
+{
+	linkLost(_sock ? _sock->errorString() : QString());
 }
 
 void PushbotConnection::
@@ -176,12 +460,18 @@ _sock_onStateChanged(QAbstractSocket::SocketState /*state*/)
 void PushbotConnection::
 _serial_error(QSerialPort::SerialPortError error)
 {
-	if (error != QSerialPort::NoError) {
-		// TODO: better error handling
-		std::cerr << "QSerialPort Error: " << error << "\n";
-		std::cerr << "Cannot recover, will exit now." << std::endl;
-		QCoreApplication::exit(1);
-	}
+	// timeouts only concern the blocking API, everything else usually
+	// means that the adapter was unplugged
+	if (error == QSerialPort::NoError || error == QSerialPort::TimeoutError)
+		return;
+	linkLost(_serial ? _serial->errorString() : QString());
+}
+
+
+void PushbotConnection::
+_native_error(const QString &msg)
+{
+	linkLost(msg);
 }
 
 
@@ -205,14 +495,307 @@ sendCommand(commands::Command *cmd)
 
 	case DVS_SERIAL_DEVICE:
 		if (_serial) _serial << *cmd;
+		if (_native) _native << *cmd;
 		break;
 
+	// a recording does not listen to commands
+	case DVS_REPLAY_DEVICE:
 	case DVS_UNKNOWN_DEVICE:
 		break;
 	}
+
+	if (cmd->t_origin && _latency)
+		_latency->command.record(monotonic_us() - cmd->t_origin);
+	if (_metrics && hasWritableDevice())
+		RobotMetrics::add(_metrics->commands_sent, 1);
 	delete cmd;
 }
 
 
+/*
+ * motor commands are packed into a single word, so that the newest one can be
+ * exchanged atomically. The valid bit distinguishes a target from no target
+ */
+static constexpr uint64_t MOTOR_TARGET_VALID = uint64_t(1) << 32;
+
+static inline uint64_t
+pack_motor_command(const commands::MotorCommand &cmd)
+{
+	return MOTOR_TARGET_VALID
+		| (static_cast<uint64_t>(cmd.type) << 16)
+		| static_cast<uint16_t>(static_cast<int16_t>(cmd.width()));
+}
+
+static inline commands::MotorCommand
+unpack_motor_command(uint64_t v, unsigned motor)
+{
+	auto type = static_cast<commands::MotorCommand::motorcmd_t>((v >> 16) & 0xFF);
+	return commands::MotorCommand(type, motor, static_cast<int16_t>(v & 0xFFFF));
+}
+
+
+void PushbotConnection::
+sendMotorCommand(const commands::MotorCommand &cmd)
+{
+	if (cmd.motor >= NMOTORS) return;
+	if (_stop_latched.load(std::memory_order_relaxed)) return;
+
+	_motor_origin[cmd.motor].store(cmd.t_origin, std::memory_order_relaxed);
+	_motor_target[cmd.motor].store(pack_motor_command(cmd), std::memory_order_release);
+	if (!_motor_wakeup_pending.exchange(true))
+		QMetaObject::invokeMethod(this, "_drain_motor_commands", Qt::QueuedConnection);
+}
+
+
+qint64 PushbotConnection::
+bytesToWrite() const
+{
+	switch (_ctype) {
+	case DVS_NETWORK_DEVICE:
+		return _sock ? _sock->bytesToWrite() : 0;
+	case DVS_SERIAL_DEVICE:
+		if (_native) return _native->bytesToWrite();
+		return _serial ? _serial->bytesToWrite() : 0;
+	default:
+		return 0;
+	}
+}
+
+
+bool PushbotConnection::
+hasWritableDevice() const
+{
+	// a recording does not take commands
+	return _sock || _serial || _native;
+}
+
+
+void PushbotConnection::
+resetMotors(bool release_stop)
+{
+	if (thread() != QThread::currentThread()) {
+		QMetaObject::invokeMethod(this, "resetMotors", Qt::QueuedConnection, Q_ARG(bool, release_stop));
+		return;
+	}
+	if (release_stop)
+		_stop_latched.store(false);
+
+	// forget what was written before, so that the zero targets go out in
+	// any case. A stop that is still latched already wrote them
+	for (unsigned i = 0; i < NMOTORS; i++) {
+		_motor_origin[i].store(0, std::memory_order_relaxed);
+		_motor_target[i].store(pack_motor_command(commands::MotorCommand(commands::MotorCommand::VELOCITY, i, 0)), std::memory_order_relaxed);
+		_motor_written[i] = 0;
+	}
+	writeMotorTargets(true);
+}
+
+
+void PushbotConnection::
+_drain_motor_commands()
+{
+	_motor_wakeup_pending.store(false);
+	writeMotorTargets(false);
+}
+
+
+void PushbotConnection::
+writeMotorTargets(bool force)
+{
+	// targets that slipped past sendMotorCommand while the stop was
+	// latched must not override it
+	if (_stop_latched.load()) {
+		for (unsigned i = 0; i < NMOTORS; i++)
+			_motor_target[i].store(0, std::memory_order_relaxed);
+		_motor_deferred = false;
+		return;
+	}
+
+	// wait until the device caught up, the newest targets will be picked
+	// up when it did
+	if (!force && bytesToWrite() > MOTOR_BACKLOG_BYTES) {
+		_motor_deferred = true;
+		return;
+	}
+	_motor_deferred = false;
+
+	// serialize the targets of all motors into one buffer
+	char buf[NMOTORS * commands::COMMAND_MAX_LENGTH];
+	size_t n = 0;
+	unsigned ncmds = 0;
+	uint64_t t_origin[NMOTORS] = {0, 0};
+	const uint64_t now = monotonic_us();
+
+	for (unsigned i = 0; i < NMOTORS; i++) {
+		uint64_t target = _motor_target[i].exchange(0, std::memory_order_acquire);
+		if (!target) continue;
+
+		// decaying commands need to be refreshed, all others are only
+		// written when they change
+		auto cmd = unpack_motor_command(target, i);
+		bool decays = cmd.type == commands::MotorCommand::DUTY_WIDTH_DECAY
+			|| cmd.type == commands::MotorCommand::VELOCITY_DECAY;
+		if (target == _motor_written[i] && (!decays || now - _motor_written_t[i] < MOTOR_REFRESH_US))
+			continue;
+
+		n += cmd.serialize(buf + n, sizeof(buf) - n);
+		ncmds++;
+		t_origin[i] = _motor_origin[i].load(std::memory_order_relaxed);
+		_motor_written[i] = target;
+		_motor_written_t[i] = now;
+	}
+	if (n == 0) return;
+
+	switch (_ctype) {
+	case DVS_NETWORK_DEVICE:
+		if (_sock) {
+			_sock->write(buf, n);
+			_sock->flush();
+		}
+		break;
+
+	case DVS_SERIAL_DEVICE:
+		if (_serial) {
+			_serial->write(buf, n);
+			_serial->flush();
+		}
+		if (_native) _native->write(buf, n);
+		break;
+
+	case DVS_REPLAY_DEVICE:
+	case DVS_UNKNOWN_DEVICE:
+		break;
+	}
+	if (_metrics && hasWritableDevice())
+		RobotMetrics::add(_metrics->commands_sent, ncmds);
+
+	if (_latency) {
+		const uint64_t t_written = monotonic_us();
+		for (unsigned i = 0; i < NMOTORS; i++)
+			if (t_origin[i]) _latency->command.record(t_written - t_origin[i]);
+	}
+}
+
+
+void PushbotConnection::
+_conn_bytesWritten(qint64 bytes)
+{
+	if (_metrics) RobotMetrics::add(_metrics->bytes_written, static_cast<uint64_t>(bytes));
+	if (_motor_deferred)
+		writeMotorTargets(false);
+}
+
+
+void PushbotConnection::
+setLatencyStats(std::shared_ptr<LatencyStats> stats)
+{
+	_latency = std::move(stats);
+}
+
+
+void PushbotConnection::
+setMetrics(std::shared_ptr<RobotMetrics> metrics)
+{
+	_metrics = std::move(metrics);
+}
+
+
+uint64_t PushbotConnection::
+receiveBufferExhausted() const
+{
+	return _buffers->exhausted();
+}
+
+
+
+void PushbotConnection::
+emergencyStop()
+{
+	// nothing that was requested before the stop shall reach the robot,
+	// and nothing that is requested afterwards until it is released
+	_stop_latched.store(true);
+	for (unsigned i = 0; i < NMOTORS; i++)
+		_motor_target[i].store(0, std::memory_order_relaxed);
+
+	bool post;
+	{
+		QMutexLocker lock(&_stop_mutex);
+		_stop_t_request = monotonic_us();
+		_stop_done = false;
+		post = !_stop_pending;
+		_stop_pending = true;
+	}
+
+	if (thread() == QThread::currentThread())
+		writeStop();
+	else if (post)
+		QCoreApplication::postEvent(this, new QEvent(STOP_EVENT), Qt::HighEventPriority);
+}
+
+
+bool PushbotConnection::
+waitForStop(unsigned long timeout_ms, uint64_t &latency)
+{
+	// wakeups can be spurious, so only wait for what is left of the
+	// timeout. Rounded up, the last wait does not end short of the deadline
+	const uint64_t deadline = monotonic_us() + static_cast<uint64_t>(timeout_ms) * 1000;
+	QMutexLocker lock(&_stop_mutex);
+	while (!_stop_done) {
+		const uint64_t now = monotonic_us();
+		if (now >= deadline)
+			return false;
+		_stop_cond.wait(&_stop_mutex, static_cast<unsigned long>((deadline - now + 999) / 1000));
+	}
+	latency = _stop_latency;
+	return true;
+}
+
+
+bool PushbotConnection::
+event(QEvent *e)
+{
+	if (e->type() == STOP_EVENT) {
+		writeStop();
+		return true;
+	}
+	return QObject::event(e);
+}
+
+
+void PushbotConnection::
+writeStop()
+{
+	static const char stop[] = "!MV0=0\n!MV1=0\n";
+
+	// the stop stands for the targets of both motors, so that the same
+	// targets are not sent again
+	const uint64_t now = monotonic_us();
+	for (unsigned i = 0; i < NMOTORS; i++) {
+		_motor_written[i] = pack_motor_command(commands::MotorCommand(commands::MotorCommand::VELOCITY, i, 0));
+		_motor_written_t[i] = now;
+	}
+
+	if (_sock && _sock->isOpen()) {
+		_sock->write(stop, sizeof(stop) - 1);
+		_sock->flush();
+	}
+	if (_serial && _serial->isOpen()) {
+		_serial->write(stop, sizeof(stop) - 1);
+		_serial->flush();
+	}
+	if (_native && _native->isOpen())
+		_native->write(stop, sizeof(stop) - 1);
+	if (_metrics && hasWritableDevice())
+		RobotMetrics::add(_metrics->commands_sent, NMOTORS);
+
+	QMutexLocker lock(&_stop_mutex);
+	_stop_latency = monotonic_us() - _stop_t_request;
+	_stop_pending = false;
+	_stop_done = true;
+	_stop_cond.wakeAll();
+	if (_latency)
+		_latency->stop.record(_stop_latency);
+}
+
 
 } // nst::
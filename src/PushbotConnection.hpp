@@ -1,21 +1,29 @@
 #ifndef __PUSHBOTCONNECTION_HPP__3E71037A_2D7F_456C_B919_BF491C99A569
 #define __PUSHBOTCONNECTION_HPP__3E71037A_2D7F_456C_B919_BF491C99A569
 
+#include <atomic>
 #include <iostream>
 #include <memory>
 #include <QMutex>
+#include <QWaitCondition>
+#include <QEvent>
 #include <QThread>
 #include <QTcpSocket>
 #include <QMetaObject>
 #include <QString>
 #include <QSerialPort>
+#include <QTimer>
+#include "LatencyHistogram.hpp"
+#include "RobotMetrics.hpp"
+#include "ReceiveBufferPool.hpp"
+#include "Commands.hpp"
 
 namespace nst {
 
 // forward declarations
-namespace commands {
-	struct Command;
-} // commands::
+class StreamRecorder;
+class StreamReplayer;
+class LinuxSerialPort;
 
 
 /*
@@ -24,6 +32,7 @@ namespace commands {
 typedef enum {
 	DVS_NETWORK_DEVICE, // network socket connection
 	DVS_SERIAL_DEVICE, // serial port connection
+	DVS_REPLAY_DEVICE, // playback of a recorded bytestream
 	DVS_UNKNOWN_DEVICE
 } CONNECTION_TYPE;
 
@@ -33,18 +42,120 @@ class PushbotConnection : public QObject
 	Q_OBJECT
 
 public:
+	static constexpr unsigned NMOTORS = 2;
+
+	// unchanged decaying motor commands are repeated after this time, so
+	// that the robot keeps its speed while the caller holds it
+	static constexpr uint64_t MOTOR_REFRESH_US = 100000;
+
+	// motor commands are held back while more than this is waiting to be
+	// written to the device, so that they do not queue up behind each other
+	static constexpr qint64 MOTOR_BACKLOG_BYTES = 64;
+
+	// connections share their thread with others, and read at most this
+	// much before they yield. This is also the size of a receive buffer
+	static constexpr size_t READ_QUANTUM = 1 << 16;
+
+	// how long to wait for a free receive buffer
+	static constexpr int RETRY_INTERVAL_MS = 1;
+
+	// data that the socket holds while all receive buffers are in use
+	static constexpr qint64 SOCKET_READ_BUFFER = 1 << 20;
+
+	// a lost link is re-established after RECONNECT_MIN_MS, doubling up
+	// to RECONNECT_MAX_MS while it keeps failing
+	static constexpr int RECONNECT_MIN_MS = 100;
+	static constexpr int RECONNECT_MAX_MS = 5000;
+	static constexpr int CONNECT_TIMEOUT_MS = 3000;
+
 	PushbotConnection(QObject *parent = 0);
 	virtual ~PushbotConnection();
 
+	/**
+	 * set the target of a motor. Only the newest target of each motor is
+	 * kept until the connection's thread writes it, all targets that
+	 * arrive in the meantime go out in one write. A target that equals
+	 * the last one that was written is suppressed. This can be called from
+	 * any thread and does not allocate memory
+	 */
+	void sendMotorCommand(const commands::MotorCommand &cmd);
+
+	/**
+	 * stop both motors as fast as possible. This drops all pending motor
+	 * targets and writes a precomputed stop command in the connection's
+	 * thread with high event priority, i.e. ahead of everything that is
+	 * still queued there. Bytes that were handed to the device before
+	 * cannot be overtaken.
+	 *
+	 * The stop is latched: all motor targets that arrive afterwards, e.g.
+	 * from user functions that are still running, are dropped until
+	 * resetMotors(true) or a new connection releases it. This can be
+	 * called from any thread
+	 */
+	void emergencyStop();
+
+	/**
+	 * wait until the last emergencyStop() was written to the device.
+	 * latency receives the time from the request to the write in us.
+	 * Returns false if this did not happen within timeout_ms
+	 */
+	bool waitForStop(unsigned long timeout_ms, uint64_t &latency);
+
+	/**
+	 * the link was lost and is waiting for the next reconnect attempt.
+	 * disconnect() cancels this. This can be called from any thread
+	 */
+	bool isReconnecting() const;
+
+	/**
+	 * number of times that all receive buffers were still held by the
+	 * parser when data arrived. This can be called from any thread
+	 */
+	uint64_t receiveBufferExhausted() const;
+
 signals:
-	void dataReady(const QByteArray &data);
+	/**
+	 * a buffer of data was read. This is emitted in the connection's
+	 * thread, and receivers are expected to connect directly and only
+	 * keep the reference, see BytestreamParser::pushData. The buffer
+	 * returns to the connection's pool when the last reference is gone.
+	 *
+	 * Nothing is allocated on the way, but the data is copied once: from
+	 * the read buffer of the device (QTcpSocket, QSerialPort or the ring
+	 * of LinuxSerialPort), or from the chunk of a recording, into the
+	 * pooled buffer
+	 */
+	void dataReady(const ReceiveBufferPtr &buf);
 	void connected();
 	void disconnected();
 
+	/**
+	 * the link was lost and will be re-established, see isReconnecting()
+	 */
+	void reconnecting();
+
 public slots:
+	/**
+	 * connect to a robot. uri is either an IP address, a serial port with
+	 * baudrate (e.g. /dev/ttyUSB0?baudrate=12000000), or a recording that
+	 * shall be played back with a certain speed (e.g. run.pbrec?replay=1).
+	 * A replay speed of 0 plays the recording as fast as possible. Append
+	 * &native=1 to a serial port to use LinuxSerialPort instead of
+	 * QSerialPort.
+	 *
+	 * Network and serial links that fail or can not be opened are
+	 * re-established with backoff until disconnect() is called. The
+	 * connection emits disconnected() and connected() again meanwhile
+	 */
 	void connect(const QString uri, uint16_t port = 56000);
 	void disconnect();
 
+	/**
+	 * record all data that is received from the robot to a file
+	 */
+	void startRecording(const QString path);
+	void stopRecording();
+
 	/**
 	 * send a command to the PushBot using the ethernet connection. this
 	 * will delete the cmd afterwards!
@@ -52,18 +163,131 @@ public slots:
 	void sendCommand(commands::Command *cmd);
 	void flush();
 
+	/**
+	 * set the velocity of both motors to 0. In contrast to
+	 * sendMotorCommand, the reset is queued along with sendCommand, so it
+	 * goes out after the commands that were sent before. Motor targets
+	 * that were not written yet are dropped. release_stop releases a
+	 * latched emergency stop, otherwise the reset leaves it in place
+	 */
+	void resetMotors(bool release_stop);
+
+	/**
+	 * histograms to which the command latency is added. set this before
+	 * connecting
+	 */
+	void setLatencyStats(std::shared_ptr<LatencyStats> stats);
+
+	/**
+	 * counters to which received bytes and written commands are added.
+	 * set this before connecting
+	 */
+	void setMetrics(std::shared_ptr<RobotMetrics> metrics);
+
 private slots:
 	void _conn_readyRead();
 
 	void _sock_connected();
 	void _sock_disconnected();
+	void _sock_error(QAbstractSocket::SocketError error);
 	void _sock_onStateChanged(QAbstractSocket::SocketState state);
+	void _reconnect_timeout();
+	void _connect_timeout();
 
 	void _serial_error(QSerialPort::SerialPortError error);
+	void _native_error(const QString &msg);
+	void _replay_data(const QByteArray &data);
+	void _drain_motor_commands();
+	void _conn_bytesWritten(qint64 bytes);
+
+protected:
+	bool event(QEvent *e) override;
 
 private:
 	QTcpSocket *_sock = nullptr;
 	QSerialPort *_serial = nullptr;
+	LinuxSerialPort *_native = nullptr;
+	StreamReplayer *_replayer = nullptr;
+	std::unique_ptr<StreamRecorder> _recorder;
+	std::shared_ptr<LatencyStats> _latency;
+	std::shared_ptr<RobotMetrics> _metrics;
+
+	qint64 bytesToWrite() const;
+	bool hasWritableDevice() const;
+
+	/*
+	 * create the device for _uri, and release it again. closeDevice() may
+	 * be called from the device's own signals
+	 */
+	void openDevice();
+	void closeDevice();
+
+	/*
+	 * the device failed. Close it and schedule a reconnect, unless the
+	 * connection was closed on purpose
+	 */
+	void linkLost(const QString &reason);
+
+	/*
+	 * emit connected() or disconnected() when the state of the link
+	 * changes
+	 */
+	void setLinkUp(bool up);
+
+	QString _uri;
+	uint16_t _port = 0;
+	bool _link_up = false;
+	bool _reconnect = false;
+	std::atomic<bool> _reconnecting{false};
+	unsigned _reconnect_attempts = 0;
+	QTimer *_reconnect_timer = nullptr;
+	QTimer *_connect_timer = nullptr;
+
+	// the next buffer is the first one of a new connection
+	bool _stream_start = false;
+
+	/*
+	 * write the newest motor targets. Unless forced, this is deferred
+	 * while the device is busy
+	 */
+	void writeMotorTargets(bool force);
+
+	// newest motor targets, packed into one word each (see
+	// pack_motor_command). 0 if there is no new target
+	std::atomic<uint64_t> _motor_target[NMOTORS];
+	std::atomic<uint64_t> _motor_origin[NMOTORS];
+	std::atomic<bool> _motor_wakeup_pending{false};
+
+	// last written targets, only used in the connection's thread
+	uint64_t _motor_written[NMOTORS] = {0, 0};
+	uint64_t _motor_written_t[NMOTORS] = {0, 0};
+	bool _motor_deferred = false;
+
+	// a read of the rest is queued behind the other connections
+	bool _read_posted = false;
+	void scheduleRead(int delay_ms);
+
+	// owned by the pool itself, as buffers may outlive this object
+	ReceiveBufferPool *_buffers = nullptr;
+
+	// part of a recorded chunk that waits for a free buffer
+	QByteArray _replay_rest;
+
+	// posted with Qt::HighEventPriority by emergencyStop()
+	static const QEvent::Type STOP_EVENT;
+
+	void writeStop();
+
+	// state of the last emergency stop, guarded by _stop_mutex
+	QMutex _stop_mutex;
+	QWaitCondition _stop_cond;
+	uint64_t _stop_t_request = 0;
+	uint64_t _stop_latency = 0;
+	bool _stop_pending = false;
+	bool _stop_done = true;
+
+	// the last emergency stop was not released yet, see emergencyStop()
+	std::atomic<bool> _stop_latched{false};
 	CONNECTION_TYPE _ctype = DVS_UNKNOWN_DEVICE;
 };
 
@@ -1,6 +1,7 @@
 #include "RCManager.hpp"
 #include "utils.hpp"
 #include "RobotControl.hpp"
+#include "IOReactor.hpp"
 #include <iostream>
 #include <deque>
 #include <vector>
@@ -13,6 +14,7 @@ namespace nst {
 // static data to hide this from the outside. this effectively works as a
 // singleton instance to the outside world
 static vector<RobotControl*> ctrls;
+static IOReactor reactor;
 
 
 uint8_t
@@ -29,12 +31,56 @@ rcman_unregister(RobotControl *ctrl) {
 }
 
 
-void
+// how long to wait for the robots to confirm an emergency stop
+static const unsigned long EMERGENCY_STOP_TIMEOUT_MS = 250;
+
+
+uint64_t
 rcman_emergency_shutdown()
 {
+	// stop the motors first. the connections write the stop in their I/O
+	// threads, so this fans out over all robots at once
+	vector<RobotControl*> stopping;
+	for (auto *ctrl: ctrls) {
+		if (!ctrl->isConnected()) continue;
+		ctrl->emergencyStop();
+		stopping.push_back(ctrl);
+	}
+
+	// collect the worst case, but don't hang on a robot that doesn't react
+	const uint64_t deadline = monotonic_us() + EMERGENCY_STOP_TIMEOUT_MS * 1000;
+	uint64_t worst = 0;
+	for (auto *ctrl: stopping) {
+		const uint64_t now = monotonic_us();
+		const unsigned long left = now < deadline ? (deadline - now) / 1000 : 0;
+		uint64_t latency;
+		if (ctrl->waitForStop(left, latency))
+			worst = max(worst, latency);
+		else
+			cerr << "EE: Robot " << static_cast<unsigned>(ctrl->id()) << " did not stop within " << EMERGENCY_STOP_TIMEOUT_MS << " ms" << endl;
+	}
+	if (!stopping.empty())
+		cout << "II: Stopped " << stopping.size() << " robots, worst-case latency " << worst << " us" << endl;
+
 	// disconnect from all controls
 	for (auto *ctrl: ctrls)
 		ctrl->disconnectRobot();
+
+	return worst;
+}
+
+
+const vector<RobotControl*>&
+rcman_controls()
+{
+	return ctrls;
+}
+
+
+IOReactor&
+rcman_reactor()
+{
+	return reactor;
 }
 
 
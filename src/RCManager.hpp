@@ -2,6 +2,7 @@
 #define __RCMANAGER_HPP__5D6F2629_8E6B_4D9C_8964_6E4D4D3B45BA
 
 #include <stdint.h>
+#include <vector>
 
 /**
  * manage multiple instances of RobotControl. each new instance needs to be
@@ -11,6 +12,7 @@
 namespace nst {
 
 class RobotControl;
+class IOReactor;
 
 
 /*
@@ -28,9 +30,23 @@ uint8_t rcman_register(RobotControl *ctrl);
 void rcman_unregister(RobotControl *ctrl);
 
 /**
- * rcman_emergency_shutdown - initiate emergency shutdown on all ctrls
+ * rcman_emergency_shutdown - initiate emergency shutdown on all ctrls. The
+ * motors of all connected robots are stopped in parallel before they are
+ * disconnected. The stops are latched, so user functions that still run
+ * cannot move the robots again. Returns the worst-case stop latency in us
  */
-void rcman_emergency_shutdown();
+uint64_t rcman_emergency_shutdown();
+
+/**
+ * rcman_controls - all registered robot controls
+ */
+const std::vector<RobotControl*>& rcman_controls();
+
+/**
+ * rcman_reactor - the threads that serve the connections and parsers of all
+ * robot controls
+ */
+IOReactor& rcman_reactor();
 
 
 
@@ -0,0 +1,79 @@
+#ifndef __RECEIVEBUFFERPOOL_HPP__6D1F8A3C_92E4_4B7D_A05C_3E8B17F9D240
+#define __RECEIVEBUFFERPOOL_HPP__6D1F8A3C_92E4_4B7D_A05C_3E8B17F9D240
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "Pool.hpp"
+
+namespace nst {
+
+/**
+ * ReceiveBuffer - a chunk of raw data that was read from a robot, along with
+ * the time at which it was read (monotonic_us).
+ *
+ * Buffers are handed out by a ReceiveBufferPool and carry a single reference
+ * count, see ReceiveBufferPtr. The connection reads into a buffer and passes
+ * it on to the parser, which decodes it in place. The buffer returns to its
+ * pool once the parser is done with it. When all buffers wait to be parsed,
+ * the connection leaves the data where it is until the parser caught up.
+ */
+class ReceiveBuffer : public PoolItem<ReceiveBuffer>
+{
+public:
+	static constexpr size_t DEFAULT_MAX_BUFFERS = 64;
+
+	size_t size() const { return _size; }
+	size_t capacity() const { return _capacity; }
+	bool empty() const { return _size == 0; }
+
+	/*
+	 * set the number of valid bytes, at most capacity()
+	 */
+	void resize(size_t n) { _size = n < _capacity ? n : _capacity; }
+
+	char* data() { return _data.get(); }
+	const char* data() const { return _data.get(); }
+
+	uint64_t readTime() const { return _t_read; }
+	void setReadTime(uint64_t t_read) { _t_read = t_read; }
+
+	/*
+	 * the buffer is the first one after the connection was (re-)opened,
+	 * i.e. it does not continue the previous data
+	 */
+	bool streamStart() const { return _stream_start; }
+	void setStreamStart(bool start) { _stream_start = start; }
+
+private:
+	friend class Pool<ReceiveBuffer>;
+
+	explicit ReceiveBuffer(size_t capacity)
+	: _capacity(capacity), _data(new char[capacity])
+	{ }
+
+	void reset()
+	{
+		_size = 0;
+		_t_read = 0;
+		_stream_start = false;
+	}
+
+	size_t _size = 0;
+	uint64_t _t_read = 0;
+	bool _stream_start = false;
+	const size_t _capacity;
+	std::unique_ptr<char[]> _data;
+};
+
+
+/*
+ * buffers are recycled through a Pool, see there for the ownership rules
+ */
+typedef Pool<ReceiveBuffer> ReceiveBufferPool;
+typedef PoolPtr<ReceiveBuffer> ReceiveBufferPtr;
+
+
+} // nst::
+
+#endif /* __RECEIVEBUFFERPOOL_HPP__6D1F8A3C_92E4_4B7D_A05C_3E8B17F9D240 */
@@ -3,14 +3,18 @@
 #include "PushbotConnection.hpp"
 #include "SensorsProcessor.hpp"
 #include "BytestreamParser.hpp"
+#include "UserFunctionWorker.hpp"
 #include "Datatypes.hpp"
 #include "Commands.hpp"
 #include "utils.hpp"
 #include "RCManager.hpp"
+#include "IOReactor.hpp"
 
 #include <QString>
 #include <QThread>
+#include <QMetaObject>
 #include <QTimer>
+#include <algorithm>
 
 namespace nst {
 
@@ -21,12 +25,17 @@ RobotControl()
 	_id = rcman_register(this);
 
 	// initialize required timers, threads and connections
-	_timer_uf = new QTimer();
-	_timer_uf->setInterval(15);
-	connect(_timer_uf, &QTimer::timeout, this, &RobotControl::onTimerUFTimeout);
-
-	_con_thread = new QThread();
-	_parser_thread = new QThread();
+	// events are usually delivered as soon as the parser has collected
+	// enough of them. this timer picks up the rest when there is only
+	// little activity
+	_timer_events = new QTimer();
+	_timer_events->setInterval(5);
+	connect(_timer_events, &QTimer::timeout, this, &RobotControl::onEventsAvailable);
+
+	// connection and parser share their threads with other robots
+	_con_thread = rcman_reactor().attachConnection();
+	_parser_thread = rcman_reactor().attachParser();
+	_uf_thread = new QThread();
 
 	_con = new PushbotConnection();
 	_con->moveToThread(_con_thread);
@@ -34,74 +43,97 @@ RobotControl()
 	_parser = new BytestreamParser(_id);
 	_parser->moveToThread(_parser_thread);
 
+	_latency = std::make_shared<LatencyStats>();
+	_con->setLatencyStats(_latency);
+	_parser->setLatencyStats(_latency);
+
+	_metrics = std::make_shared<RobotMetrics>();
+	_con->setMetrics(_metrics);
+	_parser->setMetrics(_metrics);
+
+	_pool = EventPacketPool::create(DVSEventPacket::DEFAULT_CAPACITY, DVSEventPacket::DEFAULT_MAX_PACKETS);
+
+	_worker = new UserFunctionWorker(this, _latency, _metrics);
+	_worker->moveToThread(_uf_thread);
+
 	_sensors = new SensorsProcessor();
 	connect(_sensors, &SensorsProcessor::sensorEvent, this, &RobotControl::onSensorEvent);
 
 	// connect the worker objects
-	connect(_con, &PushbotConnection::dataReady, _parser, &BytestreamParser::parseData, Qt::QueuedConnection);
+	// the connection hands its buffers over without going through the
+	// event loop
+	connect(_con, &PushbotConnection::dataReady, _parser, &BytestreamParser::pushData, Qt::DirectConnection);
 
 	// forward events from the lower level
 	connect(_con, &PushbotConnection::connected, this, &RobotControl::onPushbotConnected, Qt::QueuedConnection);
 	connect(_con, &PushbotConnection::disconnected, this, &RobotControl::onPushbotDisconnected, Qt::QueuedConnection);
-	connect(_parser, &BytestreamParser::eventReceived, this, &RobotControl::onDVSEventReceived, Qt::QueuedConnection);
+	connect(_con, &PushbotConnection::reconnecting, this, &RobotControl::reconnecting, Qt::QueuedConnection);
+	connect(_parser, &BytestreamParser::eventsAvailable, this, &RobotControl::onEventsAvailable, Qt::QueuedConnection);
 	connect(_parser, &BytestreamParser::responseReceived, this, &RobotControl::onResponseReceived, Qt::QueuedConnection);
 
 	// manage cleanup
-	connect(_parser_thread, &QThread::finished, _parser, &BytestreamParser::deleteLater);
-	connect(_parser_thread, &QThread::finished, _parser_thread, &QThread::deleteLater);
-	connect(_con_thread, &QThread::finished, _con, &PushbotConnection::deleteLater);
-	connect(_con_thread, &QThread::finished, _con_thread, &QThread::deleteLater);
+	connect(_uf_thread, &QThread::finished, _worker, &UserFunctionWorker::deleteLater);
 
 	// start the threads
-	_con_thread->start();
-	_parser_thread->start();
+	_uf_thread->start();
 }
 
 
 RobotControl::
 ~RobotControl()
 {
+	// the user function must not call into this object any longer. Once
+	// its thread is gone, the user data can be released from here
+	_uf_thread->quit();
+	_uf_thread->wait();
+	delete _uf_thread;
+
 	// invoke cleanup of user data (if necessary)
 	resetUserData();
+	_pool->release();
 
-	// shut down objects
-	_con->disconnect();
+	// shut down objects. the connection is closed before this returns,
+	// as its thread may stop right below. both objects are deleted in
+	// their threads
+	QMetaObject::invokeMethod(_con, "disconnect", Qt::BlockingQueuedConnection);
+	_con->deleteLater();
+	_parser->deleteLater();
 
 	delete _sensors;
 
-	// shut down threads
-	_parser_thread->quit();
-	_con_thread->quit();
+	// give the threads back
+	rcman_reactor().detach(_parser_thread);
+	rcman_reactor().detach(_con_thread);
 
 	rcman_unregister(this);
 }
 
 
 void RobotControl::
-resetRobot()
+resetRobot(bool release_stop)
 {
 	// always send an empty command first. This will push the PushBot's
 	// state machine to a state that new commands
-	_con->sendCommand(new commands::Empty());
+	send(new commands::Empty());
 
 	// enable event streaming, sensor streaming, and motor control
-	_con->sendCommand(new commands::DVS(true));
-	_con->sendCommand(new commands::MotorDriver(true));
-	_con->sendCommand(new commands::IMU(true));
+	send(new commands::DVS(true));
+	send(new commands::MotorDriver(true));
+	send(new commands::IMU(true));
 
-	// reset motor velocities to 0
-	_con->sendCommand(new commands::MV0(0));
-	_con->sendCommand(new commands::MV1(0));
+	// reset motor velocities to 0. This needs to go out after the empty
+	// command, so it does not take the latest-value channel of drive()
+	_con->resetMotors(release_stop);
 
 	// disable top LEDs
-	_con->sendCommand(new commands::LED());
-	_con->sendCommand(new commands::LED());
+	send(new commands::LED());
+	send(new commands::LED());
 
 	// disable buzzer
-	_con->sendCommand(new commands::Buzzer());
+	send(new commands::Buzzer());
 
 	// disable laser pointer
-	_con->sendCommand(new commands::LaserPointer());
+	send(new commands::LaserPointer());
 }
 
 
@@ -109,7 +141,7 @@ void RobotControl::
 sendCommand(std::string str)
 {
 	if (!_is_connected) return;
-	_con->sendCommand(new commands::CommandString(str));
+	send(new commands::CommandString(str));
 }
 
 
@@ -118,6 +150,7 @@ onPushbotConnected()
 {
 	// initiate the robot.
 	_is_connected = true;
+	_timer_events->start();
 	resetRobot();
 	emit connected();
 }
@@ -127,18 +160,87 @@ void RobotControl::
 onPushbotDisconnected()
 {
 	_is_connected = false;
+	_timer_events->stop();
+	onEventsAvailable();
 	emit disconnected();
 }
 
 
 void RobotControl::
-onDVSEventReceived(DVSEvent *ev)
+onEventsAvailable()
+{
+	// acknowledge first, so that the parser will wake us up again if it
+	// pushes new events while we drain the queue
+	_parser->acknowledgeWakeup();
+
+	// sensor samples were decoded by the parser already
+	IMUSample sample;
+	while (_parser->sampleQueue()->pop(sample))
+		_sensors->processSample(sample);
+
+	// move the events into pooled packets. If all packets are still in
+	// use, the events stay in the queue until the timer comes by again
+	auto *queue = _parser->eventQueue();
+	size_t n;
+	while ((n = queue->size()) > 0) {
+		auto packet = _pool->acquire();
+		if (!packet) break;
+		packet->resize(queue->pop(packet->data(), std::min(n, packet->capacity())));
+
+		// the user function gets the packet in its own thread. commands
+		// that it sends are attributed to the oldest event
+		const uint64_t t_oldest = trackDelivery(packet->size());
+		if (_userfn)
+			_worker->pushPacket(packet, t_oldest);
+
+		emit DVSEventPacketReceived(packet);
+	}
+}
+
+
+uint64_t RobotControl::
+trackDelivery(size_t n)
+{
+	// each stamp covers the events after the previous stamp up to its
+	// sequence number. A chunk counts as delivered when its last event
+	// was popped
+	const uint64_t first = _seq;
+	_seq += n;
+
+	uint64_t t_oldest = 0;
+	const uint64_t now = monotonic_us();
+	auto *stamps = _parser->stampQueue();
+	while (_stamp_valid || stamps->pop(_stamp)) {
+		_stamp_valid = true;
+		if (_stamp.seq <= first) {
+			_stamp_valid = false;
+			continue;
+		}
+		if (!t_oldest) t_oldest = _stamp.t_read;
+		if (_stamp.seq > _seq) break;
+
+		_latency->deliver.record(now - _stamp.t_read);
+		_stamp_valid = false;
+	}
+	return t_oldest;
+}
+
+
+void RobotControl::
+send(commands::Command *cmd)
+{
+	if (QThread::currentThread() == _uf_thread)
+		cmd->t_origin = _worker->origin();
+	_con->sendCommand(cmd);
+}
+
+
+void RobotControl::
+send(commands::MotorCommand cmd)
 {
-	// turn the pointer into a shared memory object. data comes from the
-	// parser and is now in our thread.
-	auto _ev = std::make_shared<DVSEvent>(std::move(*ev));
-	if (_userfn) _userfn->fn(this, _ev, std::shared_ptr<SensorEvent>());
-	emit DVSEventReceived(_ev);
+	if (QThread::currentThread() == _uf_thread)
+		cmd.t_origin = _worker->origin();
+	_con->sendMotorCommand(cmd);
 }
 
 
@@ -147,9 +249,9 @@ onResponseReceived(QString *str)
 {
 	if (!str) return;
 
-	// only emit a string response if it is _not_ a sensor package
-	if (!_sensors->parseString(str))
-		emit responseReceived(std::make_shared<QString>(std::move(*str)));
+	// sensor packages are handled by the parser, this is a response to a
+	// command. take ownership of the string
+	emit responseReceived(std::shared_ptr<QString>(str));
 }
 
 
@@ -162,13 +264,42 @@ connectRobot(const QString IP, uint16_t port)
 void RobotControl::
 disconnectRobot()
 {
-	// turn off everything
-	resetRobot();
+	// turn off everything. An emergency stop stays in place until the
+	// link is closed, as user functions might still be running
+	resetRobot(false);
 	_con->flush();
 	_con->disconnect();
 }
 
 
+void RobotControl::
+emergencyStop()
+{
+	_con->emergencyStop();
+}
+
+
+bool RobotControl::
+waitForStop(unsigned long timeout_ms, uint64_t &latency)
+{
+	return _con->waitForStop(timeout_ms, latency);
+}
+
+
+void RobotControl::
+startRecording(const QString path)
+{
+	_con->startRecording(path);
+}
+
+
+void RobotControl::
+stopRecording()
+{
+	_con->stopRecording();
+}
+
+
 bool RobotControl::
 isConnected()
 {
@@ -176,6 +307,13 @@ isConnected()
 }
 
 
+bool RobotControl::
+isReconnecting()
+{
+	return _con->isReconnecting();
+}
+
+
 void RobotControl::
 drive(float x, float y)
 {
@@ -207,34 +345,30 @@ drive(float x, float y)
 	m1speed *= m1mul;
 
 	// finally send commands. use decaying ones
-	_con->sendCommand(new commands::MVD0(static_cast<int>(floor(m0speed))));
-	_con->sendCommand(new commands::MVD1(static_cast<int>(floor(m1speed))));
-	_con->flush();
+	send(commands::MVD0(static_cast<int>(floor(m0speed))));
+	send(commands::MVD1(static_cast<int>(floor(m1speed))));
 }
 
 
 void RobotControl::
 setMotor0Speed(float m0speed)
 {
-	_con->sendCommand(new commands::MVD0(static_cast<int>(floor(m0speed))));
-	_con->flush();
+	send(commands::MVD0(static_cast<int>(floor(m0speed))));
 }
 
 
 void RobotControl::
 setMotorSpeeds(float m0speed, float m1speed)
 {
-	_con->sendCommand(new commands::MVD0(static_cast<int>(floor(m0speed))));
-	_con->sendCommand(new commands::MVD1(static_cast<int>(floor(m1speed))));
-	_con->flush();
+	send(commands::MVD0(static_cast<int>(floor(m0speed))));
+	send(commands::MVD1(static_cast<int>(floor(m1speed))));
 }
 
 
 void RobotControl::
 setMotor1Speed(float m1speed)
 {
-	_con->sendCommand(new commands::MVD1(static_cast<int>(floor(m1speed))));
-	_con->flush();
+	send(commands::MVD1(static_cast<int>(floor(m1speed))));
 }
 
 
@@ -242,56 +376,56 @@ void RobotControl::
 enableEventstream()
 {
 	if (!_is_connected) return;
-	_con->sendCommand(new commands::DVS(true));
+	send(new commands::DVS(true));
 }
 
 void RobotControl::
 disableEventstream()
 {
 	if (!_is_connected) return;
-	_con->sendCommand(new commands::DVS(false));
+	send(new commands::DVS(false));
 }
 
 void RobotControl::
 enableLEDs(unsigned base_freq, float relative_front, float relative_back)
 {
 	if (!_is_connected) return;
-	_con->sendCommand(new commands::LED(base_freq, relative_front, relative_back));
+	send(new commands::LED(base_freq, relative_front, relative_back));
 }
 
 void RobotControl::
 disableLEDs()
 {
 	if (!_is_connected) return;
-	_con->sendCommand(new commands::LED());
+	send(new commands::LED());
 }
 
 void RobotControl::
 enableLaserPointer(unsigned base_freq, float relative)
 {
 	if (!_is_connected) return;
-	_con->sendCommand(new commands::LaserPointer(base_freq, relative));
+	send(new commands::LaserPointer(base_freq, relative));
 }
 
 void RobotControl::
 disableLaserPointer()
 {
 	if (!_is_connected) return;
-	_con->sendCommand(new commands::LaserPointer());
+	send(new commands::LaserPointer());
 }
 
 void RobotControl::
 enableBuzzer(unsigned base_freq, float relative)
 {
 	if (!_is_connected) return;
-	_con->sendCommand(new commands::Buzzer(base_freq, relative));
+	send(new commands::Buzzer(base_freq, relative));
 }
 
 void RobotControl::
 disableBuzzer()
 {
 	if (!_is_connected) return;
-	_con->sendCommand(new commands::Buzzer());
+	send(new commands::Buzzer());
 }
 
 uint8_t RobotControl::
@@ -301,12 +435,18 @@ id() const
 }
 
 
+void RobotControl::
+setTimestampMode(DVSEvent::timestamp_mode_t mode)
+{
+	_parser->setTimestampMode(mode);
+}
+
+
 void RobotControl::
 setUserFunction(const UserFunction *fn)
 {
-	resetUserData();
 	_userfn = fn;
-	_timer_uf->start();
+	_worker->setUserFunction(fn);
 }
 
 
@@ -314,26 +454,18 @@ void RobotControl::
 unsetUserFunction()
 {
 	_userfn = nullptr;
-	_timer_uf->stop();
-	resetUserData();
+	_worker->setUserFunction(nullptr);
 }
 
 
 void RobotControl::
 onSensorEvent(std::shared_ptr<SensorEvent> ev)
 {
-	if (_userfn) _userfn->fn(this, std::shared_ptr<DVSEvent>(), ev);
+	if (_userfn) _worker->pushSensorEvent(ev);
 	emit sensorEvent(ev);
 }
 
 
-void RobotControl::
-onTimerUFTimeout()
-{
-	if (_userfn) _userfn->fn(this, std::shared_ptr<DVSEvent>(), std::shared_ptr<SensorEvent>());
-}
-
-
 void RobotControl::
 setUserData(void *data, void (*cleanup_fn)(void *data))
 {
@@ -356,6 +488,59 @@ resetUserData()
 	_user_cleanup_fn = nullptr;
 }
 
+uint64_t RobotControl::
+eventQueueDrops() const
+{
+	return _parser->eventQueue()->drops();
+}
+
+size_t RobotControl::
+eventQueueHighWaterMark() const
+{
+	return _parser->eventQueue()->highWaterMark();
+}
+
+size_t RobotControl::
+eventQueueCapacity() const
+{
+	return _parser->eventQueue()->capacity();
+}
+
+const LatencyStats& RobotControl::
+latencyStats() const
+{
+	return *_latency;
+}
+
+void RobotControl::
+resetLatencyStats()
+{
+	_latency->reset();
+}
+
+RobotMetricsSnapshot RobotControl::
+metrics() const
+{
+	RobotMetricsSnapshot s;
+	s.t_sample = monotonic_us();
+	s.bytes_received = _metrics->bytes_received.load(std::memory_order_relaxed);
+	s.commands_sent = _metrics->commands_sent.load(std::memory_order_relaxed);
+	s.bytes_written = _metrics->bytes_written.load(std::memory_order_relaxed);
+	s.events_decoded = _metrics->events_decoded.load(std::memory_order_relaxed);
+	s.imu_samples = _metrics->imu_samples.load(std::memory_order_relaxed);
+	s.responses = _metrics->responses.load(std::memory_order_relaxed);
+	s.userfn_calls = _metrics->userfn_calls.load(std::memory_order_relaxed);
+	s.userfn_us = _metrics->userfn_us.load(std::memory_order_relaxed);
+	s.resyncs = _parser->resyncs();
+	s.receive_buffer_exhausted = _con->receiveBufferExhausted();
+	s.input_drops = _parser->inputDrops();
+	s.event_queue_drops = _parser->eventQueue()->drops();
+	s.userfn_drops = _worker->drops();
+	s.event_queue_depth = _parser->eventQueue()->size();
+	s.event_queue_capacity = _parser->eventQueue()->capacity();
+	return s;
+}
+
 void RobotControl::
 sendUserFunctionData(int type, void *data)
 {
@@ -1,8 +1,13 @@
 #ifndef __ROBOTCONTROL_HPP__32EABE1A_2F0D_4AAB_B831_EFC05DE84126
 #define __ROBOTCONTROL_HPP__32EABE1A_2F0D_4AAB_B831_EFC05DE84126
 
+#include <atomic>
 #include <memory>
 #include <QObject>
+#include "Datatypes.hpp"
+#include "EventPacketPool.hpp"
+#include "LatencyHistogram.hpp"
+#include "RobotMetrics.hpp"
 
 // forward declarations
 class QTimer;
@@ -15,21 +20,20 @@ namespace nst {
 class PushbotConnection;
 class SensorsProcessor;
 class BytestreamParser;
-
-struct UserFunction;
-struct DVSEvent;
-struct SensorEvent;
+class UserFunctionWorker;
 
 namespace commands {
 	struct Command;
+	struct MotorCommand;
 } // commands;
 
 
 /**
  * RobotControl - Main class to operate the robot.
  * * Internally this class manages everything that runs in the background to
- * operate a robot. It will spawn threads for the data processing and socket
- * connections and forward the events to the user (or GUI).
+ * operate a robot. The socket connection and the data processing run in
+ * threads that are shared with all other robots (see IOReactor), and the
+ * events are forwarded to the user (or GUI).
  *
  * It is derived from QObject to expose the signal/slot mechanism such that the
  * GUI can listen on events, or directly hook into slots.
@@ -37,7 +41,8 @@ namespace commands {
  * Essentially it is a wrapper around all sub-classes, but exposes one interface
  * to 'the outside world' and hiding the internals.
  *
- * TODO: make the userfunction interface thread safe
+ * The user function runs in a thread of its own (see UserFunctionWorker). It
+ * may call all methods that send commands, as well as the user data methods.
  */
 class RobotControl : public QObject
 {
@@ -52,13 +57,41 @@ public:
 	bool isConnected();
 
 	/*
-	 * reset a robot to its initial state
+	 * the link was lost and gets re-established in the background.
+	 * disconnectRobot() stops this
+	 */
+	bool isReconnecting();
+
+	/*
+	 * stop the motors ahead of all queued commands, see
+	 * PushbotConnection::emergencyStop
 	 */
-	void resetRobot();
+	void emergencyStop();
+	bool waitForStop(unsigned long timeout_ms, uint64_t &latency);
+
+	/*
+	 * record the raw bytestream of the robot to a file. The recording can
+	 * be played back by connecting to "<path>?replay=<speed>"
+	 */
+	void startRecording(const QString path);
+	void stopRecording();
+
+	/*
+	 * reset a robot to its initial state. This also releases an emergency
+	 * stop, unless release_stop is false
+	 */
+	void resetRobot(bool release_stop = true);
+
+	/*
+	 * select the clock of event timestamps. see DVSEvent for details. call
+	 * this before connecting to the robot
+	 */
+	void setTimestampMode(DVSEvent::timestamp_mode_t mode);
 
 	/*
 	 * set a user function which will be called everytime an event is
-	 * received.
+	 * received. It is called in the user function thread, and takes over
+	 * once the user data of the previous function was released.
 	 */
 	void setUserFunction(const UserFunction *fn);
 	void unsetUserFunction();
@@ -125,7 +158,8 @@ public:
 	 * be passed that will be called when the RobotControl gets destroyed,
 	 * or the user-data is set again
 	 *
-	 * TODO: check thread safety
+	 * These are meant to be called from the user function, i.e. from the
+	 * user function thread only.
 	 */
 	void setUserData(void *data, void (*cleanup_fn)(void *data));
 	void* getUserData();
@@ -136,35 +170,89 @@ public:
 	 */
 	void sendUserFunctionData(int type, void *data);
 
+	/**
+	 * statistics of the queue between parser and robot control. the drop
+	 * count is the number of events that did not fit into the queue, the
+	 * high-water mark is the maximum number of events that were waiting
+	 */
+	uint64_t eventQueueDrops() const;
+	size_t eventQueueHighWaterMark() const;
+	size_t eventQueueCapacity() const;
+
+	/**
+	 * latencies from the arrival of data to the decoded events, their
+	 * delivery, the return of the user function, and commands that were
+	 * sent in response
+	 */
+	const LatencyStats& latencyStats() const;
+	void resetLatencyStats();
+
+	/**
+	 * throughput counters of the connection, parser and user function,
+	 * along with the state of the queues in between. Rates follow from
+	 * two snapshots, see RobotMetricsSnapshot. This can be called from any
+	 * thread
+	 */
+	RobotMetricsSnapshot metrics() const;
+
 signals:
 	void connected();
 	void disconnected();
+	void reconnecting();
 
 	void responseReceived(std::shared_ptr<QString> str);
-	void DVSEventReceived(std::shared_ptr<DVSEvent> ev);
+	void DVSEventPacketReceived(const DVSEventPacketPtr &packet);
 	void sensorEvent(std::shared_ptr<SensorEvent> ev);
 	void userFunctionData(uint8_t id, int type, void *data);
 
 private slots:
 	void onPushbotConnected();
 	void onPushbotDisconnected();
-	void onDVSEventReceived(DVSEvent *ev);
+	void onEventsAvailable();
 	void onResponseReceived(QString *str);
 	void onSensorEvent(std::shared_ptr<SensorEvent> ev);
-	void onTimerUFTimeout();
 
 private:
-	QTimer *_timer_uf = nullptr;
+	/*
+	 * send a command to the robot. Commands of the user function are
+	 * tagged with the arrival time of the data that it currently processes
+	 */
+	void send(commands::Command *cmd);
+	void send(commands::MotorCommand cmd);
+
+	/*
+	 * account for n delivered events. returns the arrival time of the
+	 * oldest of them, or 0 if it is unknown
+	 */
+	uint64_t trackDelivery(size_t n);
+
+	QTimer *_timer_events = nullptr;
 	QThread *_con_thread = nullptr;
 	QThread *_parser_thread = nullptr;
+	QThread *_uf_thread = nullptr;
 
 	SensorsProcessor *_sensors = nullptr;
 	PushbotConnection *_con = nullptr;
 	BytestreamParser *_parser = nullptr;
+	UserFunctionWorker *_worker = nullptr;
+
+	// packets of events that were handed out. owned by the pool itself,
+	// as packets may outlive this object
+	EventPacketPool *_pool = nullptr;
 
+	// the user function as seen from this object's thread. the worker has
+	// its own copy
 	const UserFunction *_userfn = nullptr;
 
-	bool _is_connected = false;
+	std::atomic<bool> _is_connected{false};
+
+	// latency measurement. _stamp is the oldest chunk whose events were
+	// not yet delivered completely, _seq the number of delivered events
+	std::shared_ptr<LatencyStats> _latency;
+	std::shared_ptr<RobotMetrics> _metrics;
+	ChunkStamp _stamp;
+	bool _stamp_valid = false;
+	uint64_t _seq = 0;
 
 	// each robot control gets its own ID
 	uint8_t _id;
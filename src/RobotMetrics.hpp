@@ -0,0 +1,115 @@
+#ifndef __ROBOTMETRICS_HPP__9B3E5F27_C81A_4D6E_A4F2_70D5B96E13C8
+#define __ROBOTMETRICS_HPP__9B3E5F27_C81A_4D6E_A4F2_70D5B96E13C8
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace nst {
+
+/**
+ * RobotMetrics - throughput counters of one robot along the processing
+ * pipeline. The counters only ever grow, rates are computed from the
+ * difference of two snapshots (see RobotMetricsSnapshot).
+ *
+ * Each counter is written by exactly one thread: the connection's, the
+ * parser's or the user function's. Adding is therefore a relaxed load and
+ * store instead of an atomic read-modify-write, which keeps it cheap enough
+ * for the hot path. Any thread may read at any time.
+ */
+struct RobotMetrics
+{
+	// connection: raw data that was read from the robot, and commands
+	// that were written to it
+	std::atomic<uint64_t> bytes_received{0};
+	std::atomic<uint64_t> commands_sent{0};
+	std::atomic<uint64_t> bytes_written{0};
+
+	// parser: events that went into the event queue, decoded IMU samples,
+	// and all other response lines
+	std::atomic<uint64_t> events_decoded{0};
+	std::atomic<uint64_t> imu_samples{0};
+	std::atomic<uint64_t> responses{0};
+
+	// user function: number of calls and the time spent in them
+	std::atomic<uint64_t> userfn_calls{0};
+	std::atomic<uint64_t> userfn_us{0};
+
+	/*
+	 * add n to a counter. Only to be called from the counter's thread
+	 */
+	static void add(std::atomic<uint64_t> &counter, uint64_t n)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+};
+
+
+/**
+ * RobotMetricsSnapshot - the counters of RobotMetrics at one point in time,
+ * along with the state of the queues between the stages. Reads are not
+ * consistent across counters, which does not matter for statistics.
+ */
+struct RobotMetricsSnapshot
+{
+	// monotonic_us at which the snapshot was taken
+	uint64_t t_sample = 0;
+
+	uint64_t bytes_received = 0;
+	uint64_t commands_sent = 0;
+	uint64_t bytes_written = 0;
+	uint64_t events_decoded = 0;
+	uint64_t imu_samples = 0;
+	uint64_t responses = 0;
+	uint64_t userfn_calls = 0;
+	uint64_t userfn_us = 0;
+
+	// number of times the parser searched for the next event
+	uint64_t resyncs = 0;
+
+	// the connection found all receive buffers in use, the parser's input
+	// queue was full, the event queue was full, and the user function's
+	// queue was full. All of them point at the next stage being too slow
+	uint64_t receive_buffer_exhausted = 0;
+	uint64_t input_drops = 0;
+	uint64_t event_queue_drops = 0;
+	uint64_t userfn_drops = 0;
+
+	// events that wait between parser and RobotControl
+	size_t event_queue_depth = 0;
+	size_t event_queue_capacity = 0;
+
+	/*
+	 * per-second rate of a counter since an earlier snapshot, e.g.
+	 * now.rate(before, &RobotMetricsSnapshot::events_decoded)
+	 */
+	double rate(const RobotMetricsSnapshot &before, uint64_t RobotMetricsSnapshot::*counter) const
+	{
+		if (t_sample <= before.t_sample) return 0.0;
+		return (this->*counter - before.*counter) * 1e6 / (t_sample - before.t_sample);
+	}
+
+	/*
+	 * average time of a user function call since an earlier snapshot in us
+	 */
+	double userfnTimePerCall(const RobotMetricsSnapshot &before) const
+	{
+		const uint64_t calls = userfn_calls - before.userfn_calls;
+		return calls ? static_cast<double>(userfn_us - before.userfn_us) / calls : 0.0;
+	}
+
+	/*
+	 * fraction of the time since an earlier snapshot that the user
+	 * function was busy. Close to 1 means that it limits the throughput
+	 */
+	double userfnLoad(const RobotMetricsSnapshot &before) const
+	{
+		if (t_sample <= before.t_sample) return 0.0;
+		return static_cast<double>(userfn_us - before.userfn_us) / (t_sample - before.t_sample);
+	}
+};
+
+
+} // nst::
+
+#endif /* __ROBOTMETRICS_HPP__9B3E5F27_C81A_4D6E_A4F2_70D5B96E13C8 */
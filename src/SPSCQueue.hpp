@@ -0,0 +1,166 @@
+#ifndef __SPSCQUEUE_HPP__BD6C3156_C986_47A0_81E7_681FE866FF54
+#define __SPSCQUEUE_HPP__BD6C3156_C986_47A0_81E7_681FE866FF54
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <algorithm>
+
+namespace nst {
+
+/**
+ * size of a cache line. data that is written by different threads is kept at
+ * least this far apart to avoid false sharing
+ */
+constexpr size_t CACHELINE_SIZE = 64;
+
+
+/**
+ * SPSCQueue - bounded, lock-free single-producer/single-consumer ring buffer.
+ *
+ * Exactly one thread may push, and exactly one thread may pop. The capacity is
+ * rounded up to the next power of two. Pushing into a full queue drops the
+ * element and increments a counter. The high-water mark records the largest
+ * fill level the producer has seen (an upper bound, as the producer only
+ * periodically refreshes its view of the consumer). Both statistics can be
+ * read from any thread and help to size the queue under load.
+ */
+template <typename T>
+class SPSCQueue
+{
+public:
+	explicit SPSCQueue(size_t capacity)
+	: _mask(round_capacity(capacity) - 1), _buffer(new T[_mask + 1])
+	{ }
+
+	SPSCQueue(const SPSCQueue&) = delete;
+	SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+	/*
+	 * producer side. returns false if the queue was full and the element
+	 * got dropped
+	 */
+	bool push(const T &v)
+	{
+		return push(&v, 1) == 1;
+	}
+
+	/*
+	 * producer side. push up to n elements, returns how many were actually
+	 * pushed. all others are dropped
+	 */
+	size_t push(const T *v, size_t n)
+	{
+		const size_t tail = _tail.load(std::memory_order_relaxed);
+		size_t free = capacity() - (tail - _head_cached);
+		if (free < n) {
+			_head_cached = _head.load(std::memory_order_acquire);
+			free = capacity() - (tail - _head_cached);
+		}
+
+		const size_t count = std::min(n, free);
+		const size_t first = std::min(count, capacity() - (tail & _mask));
+		T *buf = _buffer.get();
+		std::copy(v, v + first, buf + (tail & _mask));
+		std::copy(v + first, v + count, buf);
+		_tail.store(tail + count, std::memory_order_release);
+
+		if (count < n)
+			_drops.fetch_add(n - count, std::memory_order_relaxed);
+		const size_t fill = tail + count - _head_cached;
+		if (fill > _hwm.load(std::memory_order_relaxed))
+			_hwm.store(fill, std::memory_order_relaxed);
+
+		return count;
+	}
+
+	/*
+	 * consumer side. returns false if the queue was empty
+	 */
+	bool pop(T &v)
+	{
+		return pop(&v, 1) == 1;
+	}
+
+	/*
+	 * consumer side. pop up to n elements into v, returns how many were
+	 * actually popped. Elements are moved out, so that the queue does not
+	 * keep resources alive
+	 */
+	size_t pop(T *v, size_t n)
+	{
+		const size_t head = _head.load(std::memory_order_relaxed);
+		size_t avail = _tail_cached - head;
+		if (avail < n) {
+			_tail_cached = _tail.load(std::memory_order_acquire);
+			avail = _tail_cached - head;
+		}
+
+		const size_t count = std::min(n, avail);
+		const size_t first = std::min(count, capacity() - (head & _mask));
+		T *buf = _buffer.get();
+		std::move(buf + (head & _mask), buf + (head & _mask) + first, v);
+		std::move(buf, buf + (count - first), v + first);
+		_head.store(head + count, std::memory_order_release);
+
+		return count;
+	}
+
+	/*
+	 * number of elements currently in the queue. exact only when called
+	 * from the producer or consumer while the other side is idle
+	 */
+	size_t size() const
+	{
+		return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+	}
+
+	bool empty() const { return size() == 0; }
+	size_t capacity() const { return _mask + 1; }
+
+	uint64_t drops() const { return _drops.load(std::memory_order_relaxed); }
+	size_t highWaterMark() const { return _hwm.load(std::memory_order_relaxed); }
+
+	/*
+	 * reset drop counter and high-water mark
+	 */
+	void resetStatistics()
+	{
+		_drops.store(0, std::memory_order_relaxed);
+		_hwm.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	static size_t round_capacity(size_t n)
+	{
+		size_t c = 2;
+		while (c < n) c <<= 1;
+		return c;
+	}
+
+	char _pad0[CACHELINE_SIZE];
+
+	// written by the consumer
+	std::atomic<size_t> _head{0};
+	size_t _tail_cached = 0;
+
+	char _pad1[CACHELINE_SIZE];
+
+	// written by the producer
+	std::atomic<size_t> _tail{0};
+	size_t _head_cached = 0;
+	std::atomic<uint64_t> _drops{0};
+	std::atomic<size_t> _hwm{0};
+
+	char _pad2[CACHELINE_SIZE];
+
+	// read-only after construction
+	const size_t _mask;
+	std::unique_ptr<T[]> _buffer;
+};
+
+
+} // nst::
+
+#endif /* __SPSCQUEUE_HPP__BD6C3156_C986_47A0_81E7_681FE866FF54 */
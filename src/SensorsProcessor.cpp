@@ -25,77 +25,45 @@ SensorsProcessor::
 
 
 
+bool SensorsProcessor::
+parseLine(const char *str, size_t len)
+{
+	if (!isSensorLine(str, len)) return false;
+
+	IMUSample sample;
+	if (decodeSensorLine(str, len, sample))
+		processSample(sample);
+	return true;
+}
+
+
 bool SensorsProcessor::
 parseString(const QString *str)
 {
-	// check if and which sensor we have (S10 - gyro, S11 - acc, S12 - mag)
-	auto s = str->left(3);
-	if (s != "-S1") return false;
-
-	// extract the type of data
-	QStringRef sensor_type_str(str, 3, 1);
-	auto sensor_type = sensor_type_str.toInt();
-
-	// retrieve the data
-	auto data = str->right(str->length() - 5);
-
-	// parse the response into corresponding structs
-        // one response per sensor
-        IMUEvent *se = new IMUEvent;
-	QStringList axesVals = data.split(" ");
-	int axisIdx = 0;
-	foreach(const QString axisEntry, axesVals) {
-		switch(sensor_type) {
-			case 0:
-				se->g[axisIdx]= decodeSensorVal(axisEntry);
-				break;
-			case 1:
-				se->a[axisIdx]= decodeSensorVal(axisEntry);
-				break;
-			case 2:
-				se->m[axisIdx]= decodeSensorVal(axisEntry);
-				break;
-		}
-		if (++axisIdx > 2) break;
-	}
+	auto line = str->toLatin1();
+	return parseLine(line.constData(), line.size());
+}
 
-	processSample(se);
-	delete se;
-
-	/*
-
-
-
-        // check which sensor we have (S10 - gyro, S11 - acc, S12 - mag)
-        short seIdx = str->contains("-S10", Qt::CaseInsensitive)?0:(str->contains("-S11", Qt::CaseInsensitive)?1:2);
-
-	// extract the content of the robot stream
-        QStringList rawData = str->split(QRegularExpression("-S1\\d\\s"), QString::SkipEmptyParts);
-        foreach(const QString &sensorEntry, rawData){
-                QStringList axesVals = sensorEntry.split(" ");
-                axisIdx = 0;
-                foreach(const QString axisEntry, axesVals){
-                        switch(sensor_type){
-                                case 0:
-                                        se->g[axisIdx]= decodeSensorVal(axisEntry);
-                                        break;
-                                case 1:
-                                        se->a[axisIdx]= decodeSensorVal(axisEntry);
-                                        break;
-                                case 2:
-                                        se->m[axisIdx]= decodeSensorVal(axisEntry);
-                                        break;
-                        }
-                       if((axisIdx++)==2) break;
-                }
-        }
-
-        // ... and send the packed struct to update RPY
-        processSample(se);
-	delete se;
-	*/
 
-	return true;
+void SensorsProcessor::
+processSample(const IMUSample &sample)
+{
+	// one response per sensor
+	IMUEvent se;
+	for (int axis = 0; axis < 3; axis++) {
+		switch (sample.type) {
+		case IMUEvent::GYROSCOPE:
+			se.g[axis] = sample.v[axis];
+			break;
+		case IMUEvent::ACCELEROMETER:
+			se.a[axis] = sample.v[axis];
+			break;
+		case IMUEvent::MAGNETOMETER:
+			se.m[axis] = sample.v[axis];
+			break;
+		}
+	}
+	processSample(&se);
 }
 
 
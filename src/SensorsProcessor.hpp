@@ -3,6 +3,8 @@
 
 #include <QObject>
 #include <cmath>
+#include <cstdlib>
+#include <cstdint>
 #include <iostream>
 #include <memory>
 #include "Datatypes.hpp"
@@ -27,12 +29,14 @@ public:
         ~SensorsProcessor();
 
 	bool parseString(const QString *str);
+	bool parseLine(const char *str, size_t len);
 
 signals:
 	void sensorEvent(std::shared_ptr<SensorEvent> ev);
 
 public:
         void processSample(const IMUEvent *ev);
+        void processSample(const IMUSample &sample);
 
 private:
 	RPYEvent * _rpyEstimate; // estimates
@@ -41,7 +45,9 @@ private:
 
 
 /**
- * decode incoming sensory values from IMU (encoding is Q16)
+ * decode incoming sensory values from IMU (encoding is Q16). This is the
+ * legacy path, kept as a reference for the benchmarks. Use decodeQ16 or
+ * decodeSensorLine in new code
  */
 inline
 double decodeSensorVal(QString str)
@@ -52,6 +58,70 @@ double decodeSensorVal(QString str)
     return  ((bStr.test(31))?(((double)(bStr.flip(31).to_ulong()) - pow(2, 31))/pow(2,16)):((double)(bStr.to_ulong())/pow(2,16)));
 }
 
+/**
+ * check if a response line contains IMU data, i.e. starts with "-S1"
+ */
+inline
+bool isSensorLine(const char *str, size_t len)
+{
+	return len >= 3 && str[0] == '-' && str[1] == 'S' && str[2] == '1';
+}
+
+
+/**
+ * value of a hex digit, or 16 if c is no hex digit. Compiles to conditional
+ * moves instead of branches
+ */
+inline
+unsigned hexDigit(unsigned char c)
+{
+	unsigned d = c - '0';
+	unsigned l = (c | 0x20) - 'a';
+	unsigned v = l < 6 ? l + 10 : 16;
+	return d < 10 ? d : v;
+}
+
+
+/**
+ * decode one hex value in two's complement Q16 format, skipping leading
+ * blanks. Returns the position after the value
+ */
+inline
+const char* decodeQ16(const char *p, const char *end, double &v)
+{
+	while (p < end && *p == ' ') ++p;
+
+	uint32_t raw = 0;
+	unsigned d;
+	while (p < end && (d = hexDigit(*p)) < 16) {
+		raw = (raw << 4) | d;
+		++p;
+	}
+	v = static_cast<int32_t>(raw) * (1.0 / 65536.0);
+	return p;
+}
+
+
+/**
+ * decode an IMU response line of the form "-S1x <hex> <hex> <hex>" straight
+ * from a character buffer, where x is the sensor type. All three axes are
+ * decoded in a single pass over the line. Returns false if the line is no
+ * valid sensor line.
+ */
+inline
+bool decodeSensorLine(const char *str, size_t len, IMUSample &sample)
+{
+	if (len < 5 || !isSensorLine(str, len)) return false;
+	if (str[3] < '0' || str[3] > '2') return false;
+	sample.type = static_cast<IMUEvent::sensortype_t>(str[3] - '0');
+
+	const char *p = str + 4;
+	const char *end = str + len;
+	for (int axis = 0; axis < 3; axis++)
+		p = decodeQ16(p, end, sample.v[axis]);
+	return true;
+}
+
 } // nst::
 
 #endif /* __SENSORSPROCESSOR_HPP__50486FA1_C215_4455_A737_ADAFD76CA620 */
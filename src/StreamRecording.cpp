@@ -0,0 +1,252 @@
+#include "StreamRecording.hpp"
+#include <cstring>
+#include <iostream>
+#include <QTimer>
+#include "utils.hpp"
+
+namespace nst {
+
+
+StreamRecorder::
+StreamRecorder()
+{ }
+
+
+StreamRecorder::
+~StreamRecorder()
+{
+	close();
+}
+
+
+bool StreamRecorder::
+open(const QString &path)
+{
+	close();
+
+	_file.setFileName(path);
+	if (!_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		std::cerr << "EE: Cannot open recording " << path.toStdString() << ": " << _file.errorString().toStdString() << std::endl;
+		return false;
+	}
+
+	StreamRecordingHeader hdr;
+	std::memcpy(hdr.magic, STREAM_MAGIC, sizeof(hdr.magic));
+	hdr.version = StreamRecordingHeader::VERSION;
+	hdr.reserved = 0;
+	_file.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+
+	_first = true;
+	return true;
+}
+
+
+void StreamRecorder::
+close()
+{
+	if (_file.isOpen()) {
+		_file.flush();
+		_file.close();
+	}
+}
+
+
+bool StreamRecorder::
+isOpen() const
+{
+	return _file.isOpen();
+}
+
+
+void StreamRecorder::
+record(const QByteArray &data, uint64_t t_us)
+{
+	record(data.constData(), data.size(), t_us);
+}
+
+
+void StreamRecorder::
+record(const char *data, uint32_t len, uint64_t t_us)
+{
+	if (!_file.isOpen()) return;
+
+	if (_first) {
+		_t0 = t_us;
+		_first = false;
+	}
+
+	// QFile buffers the writes, so this does not hit the disk for each
+	// chunk
+	char hdr[STREAM_CHUNK_HEADER_SIZE];
+	uint64_t t = t_us - _t0;
+	std::memcpy(hdr, &t, sizeof(t));
+	std::memcpy(hdr + sizeof(t), &len, sizeof(len));
+	_file.write(hdr, sizeof(hdr));
+	_file.write(data, len);
+}
+
+
+StreamReplayer::
+StreamReplayer(QObject *parent)
+: QObject(parent)
+{
+	_timer = new QTimer(this);
+	_timer->setSingleShot(true);
+	_timer->setTimerType(Qt::PreciseTimer);
+	connect(_timer, &QTimer::timeout, this, &StreamReplayer::_replay);
+}
+
+
+StreamReplayer::
+~StreamReplayer()
+{
+	close();
+}
+
+
+bool StreamReplayer::
+open(const QString &path)
+{
+	close();
+
+	_file.setFileName(path);
+	if (!_file.open(QIODevice::ReadOnly)) {
+		std::cerr << "EE: Cannot open recording " << path.toStdString() << ": " << _file.errorString().toStdString() << std::endl;
+		return false;
+	}
+
+	_size = _file.size();
+	_data = _size >= static_cast<qint64>(sizeof(StreamRecordingHeader)) ? _file.map(0, _size) : nullptr;
+	if (!_data) {
+		std::cerr << "EE: Cannot map recording " << path.toStdString() << std::endl;
+		close();
+		return false;
+	}
+
+	StreamRecordingHeader hdr;
+	std::memcpy(&hdr, _data, sizeof(hdr));
+	if (std::memcmp(hdr.magic, STREAM_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != StreamRecordingHeader::VERSION) {
+		std::cerr << "EE: " << path.toStdString() << " is no valid recording" << std::endl;
+		close();
+		return false;
+	}
+
+	_pos = sizeof(hdr);
+	return true;
+}
+
+
+void StreamReplayer::
+close()
+{
+	_timer->stop();
+	if (_data) _file.unmap(const_cast<uchar*>(_data));
+	if (_file.isOpen()) _file.close();
+	_data = nullptr;
+	_size = 0;
+	_pos = 0;
+}
+
+
+bool StreamReplayer::
+isOpen() const
+{
+	return _data != nullptr;
+}
+
+
+void StreamReplayer::
+setSpeed(double speed)
+{
+	_speed = speed > 0.0 ? speed : 0.0;
+}
+
+
+double StreamReplayer::
+speed() const
+{
+	return _speed;
+}
+
+
+void StreamReplayer::
+start()
+{
+	if (!_data) return;
+	_t_start = monotonic_us();
+	_timer->start(0);
+}
+
+
+void StreamReplayer::
+stop()
+{
+	_timer->stop();
+}
+
+
+void StreamReplayer::
+pause()
+{
+	_paused = true;
+	_timer->stop();
+}
+
+
+void StreamReplayer::
+resume()
+{
+	if (!_paused) return;
+	_paused = false;
+	if (_data) _timer->start(0);
+}
+
+
+bool StreamReplayer::
+peekChunk(uint64_t &t_us, uint32_t &len) const
+{
+	if (_size - _pos < static_cast<qint64>(STREAM_CHUNK_HEADER_SIZE)) return false;
+	std::memcpy(&t_us, _data + _pos, sizeof(t_us));
+	std::memcpy(&len, _data + _pos + sizeof(t_us), sizeof(len));
+
+	// a recording that was cut off ends with an incomplete chunk
+	return _size - _pos - static_cast<qint64>(STREAM_CHUNK_HEADER_SIZE) >= len;
+}
+
+
+void StreamReplayer::
+_replay()
+{
+	uint64_t t_us;
+	uint32_t len;
+	unsigned n = 0;
+	const uint64_t now = monotonic_us() - _t_start;
+
+	while (peekChunk(t_us, len)) {
+		if (_speed > 0.0) {
+			// schedule the next chunk when it is due
+			const uint64_t due = static_cast<uint64_t>(t_us / _speed);
+			if (due > now) {
+				_timer->start(static_cast<int>((due - now) / 1000));
+				return;
+			}
+		}
+		else if (n++ == FAST_BATCH) {
+			// let the event loop breathe
+			_timer->start(0);
+			return;
+		}
+
+		const char *chunk = reinterpret_cast<const char*>(_data + _pos + STREAM_CHUNK_HEADER_SIZE);
+		_pos += STREAM_CHUNK_HEADER_SIZE + len;
+		emit dataReady(QByteArray::fromRawData(chunk, static_cast<int>(len)));
+
+		// the receiver may have paused us
+		if (_paused) return;
+	}
+
+	emit finished();
+}
+
+
+} // nst::
@@ -0,0 +1,133 @@
+#ifndef __STREAMRECORDING_HPP__9C1E4B7A_5D3F_4E8B_A2C6_71F0D8E3B94D
+#define __STREAMRECORDING_HPP__9C1E4B7A_5D3F_4E8B_A2C6_71F0D8E3B94D
+
+#include <stdint.h>
+#include <QObject>
+#include <QFile>
+#include <QString>
+#include <QByteArray>
+
+// forward declarations
+class QTimer;
+
+namespace nst {
+
+/*
+ * Recordings contain the raw bytes that were received from a robot, exactly as
+ * they arrived in chunks on the socket or serial port. The file starts with a
+ * header, followed by all chunks. Integers are stored in host byte order.
+ *
+ *   header: char magic[8] = "PBRCSTRM", uint32_t version, uint32_t reserved
+ *   chunk:  uint64_t t_us, uint32_t length, uint8_t data[length]
+ *
+ * t_us is the arrival time of the chunk relative to the first chunk of the
+ * recording in microseconds.
+ */
+struct StreamRecordingHeader
+{
+	static constexpr uint32_t VERSION = 1;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+static constexpr size_t STREAM_CHUNK_HEADER_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+static const char STREAM_MAGIC[8] = {'P', 'B', 'R', 'C', 'S', 'T', 'R', 'M'};
+
+
+/**
+ * StreamRecorder - write the bytestream of a robot to a file
+ */
+class StreamRecorder
+{
+public:
+	StreamRecorder();
+	~StreamRecorder();
+
+	bool open(const QString &path);
+	void close();
+	bool isOpen() const;
+
+	/*
+	 * append a chunk that arrived at time t_us of the host's monotonic
+	 * clock
+	 */
+	void record(const QByteArray &data, uint64_t t_us);
+	void record(const char *data, uint32_t len, uint64_t t_us);
+
+private:
+	QFile _file;
+	uint64_t _t0 = 0;
+	bool _first = true;
+};
+
+
+/**
+ * StreamReplayer - play back a recording from a memory mapped file.
+ *
+ * The chunks are emitted with the same timing as they were recorded, scaled by
+ * the replay speed. A speed of 0 replays the file as fast as possible, which is
+ * useful to benchmark the processing pipeline. Each chunk is handed out
+ * without a copy, as a QByteArray that refers to the mapping. It is only valid
+ * during dataReady(), so receivers connect directly and copy what they keep.
+ */
+class StreamReplayer : public QObject
+{
+	Q_OBJECT
+
+public:
+	StreamReplayer(QObject *parent = 0);
+	virtual ~StreamReplayer();
+
+	bool open(const QString &path);
+	void close();
+	bool isOpen() const;
+
+	void setSpeed(double speed);
+	double speed() const;
+
+public slots:
+	void start();
+	void stop();
+
+	/*
+	 * hold back further chunks, e.g. while the receiver has no room for
+	 * them. The replay clock keeps running, chunks that became due in the
+	 * meantime follow right after resume()
+	 */
+	void pause();
+	void resume();
+
+signals:
+	void dataReady(const QByteArray &data);
+	void finished();
+
+private slots:
+	void _replay();
+
+private:
+	/*
+	 * read the chunk header at the current position. returns false if
+	 * there is no complete chunk left
+	 */
+	bool peekChunk(uint64_t &t_us, uint32_t &len) const;
+
+	// chunks that are emitted at once when replaying as fast as possible,
+	// before control goes back to the event loop
+	static constexpr unsigned FAST_BATCH = 64;
+
+	QFile _file;
+	QTimer *_timer = nullptr;
+	const uchar *_data = nullptr;
+	qint64 _size = 0;
+	qint64 _pos = 0;
+	double _speed = 1.0;
+	uint64_t _t_start = 0;
+	bool _paused = false;
+};
+
+
+} // nst::
+
+#endif /* __STREAMRECORDING_HPP__9C1E4B7A_5D3F_4E8B_A2C6_71F0D8E3B94D */
@@ -9,14 +9,41 @@ using namespace std;
 using namespace nst;
 
 
+/*
+ * user data of the demo functions. Each robot calls its function from its own
+ * thread, so the call counter lives in the robot's user data
+ */
+struct demo_data {
+	unsigned calls{0};
+};
+
+
+void cleanup_demo(void *raw_data)
+{
+	if (raw_data == nullptr) return;
+	delete static_cast<demo_data*>(raw_data);
+}
+
+
+demo_data* init_demo(RobotControl * const control)
+{
+	auto data = static_cast<demo_data*>(control->getUserData());
+	if (data == nullptr) {
+		data = new demo_data;
+		control->setUserData(data, cleanup_demo);
+	}
+	return data;
+}
+
+
 void
 demo_function_1(RobotControl * const control,
 		shared_ptr<DVSEvent> dvs_ev,
 		shared_ptr<SensorEvent> sensor_ev)
 {
-	static int i = 0;
-	++i %= 1000;
-	if (!i) {
+	demo_data *data = init_demo(control);
+	++data->calls %= 1000;
+	if (!data->calls) {
 		cout << "demo function 1 called 1000 times. robot " << unsigned(control->id()) << ". ";
 
 		if (dvs_ev) {
@@ -40,9 +67,9 @@ demo_function_2(RobotControl * const control,
 		shared_ptr<DVSEvent> dvs_ev,
 		shared_ptr<SensorEvent> sensor_ev)
 {
-	static int i = 0;
-	++i %= 5000;
-	if (!i) {
+	demo_data *data = init_demo(control);
+	++data->calls %= 5000;
+	if (!data->calls) {
 		cout << "demo function 2 called 5000 times. robot " << unsigned(control->id()) << ". ";
 		if (dvs_ev) {
 			cout << "triggered by DVS event at ("
@@ -66,6 +93,51 @@ demo_function_2(RobotControl * const control,
 }
 
 
+/*
+ * user data of the event rate printer. Each robot calls the function from its
+ * own thread, so the counters need to live in the robot's user data
+ */
+struct event_rate_data {
+	unsigned ticks{0};
+	uint64_t events{0};
+	uint64_t sensors{0};
+};
+
+
+void cleanup_event_rate(void *raw_data)
+{
+	if (raw_data == nullptr) return;
+	delete static_cast<event_rate_data*>(raw_data);
+}
+
+
+void
+event_rate_batch(RobotControl * const control,
+		const UserFunctionBatch &batch)
+{
+	// set up the data struct if necessary
+	auto data = static_cast<event_rate_data*>(control->getUserData());
+	if (data == nullptr) {
+		data = new event_rate_data;
+		control->setUserData(data, cleanup_event_rate);
+	}
+
+	// the tick comes every 15ms. print the rates roughly once per second
+	data->events += batch.nevents;
+	data->sensors += batch.nsensors;
+
+	if (batch.nevents || batch.nsensors) return;
+	if (++data->ticks < 66) return;
+
+	cout << "robot " << unsigned(control->id()) << ": "
+		<< data->events << " events, "
+		<< data->sensors << " sensor events in " << data->ticks << " ticks"
+		<< std::endl;
+	data->ticks = 0;
+	data->events = data->sensors = 0;
+}
+
+
 /*
  *
  * reconstructing the LED tracking mechanism for the robot chain
@@ -184,6 +256,8 @@ _led_tracker(bool with_driving_commands,
 		data->ev_counter %= 2;
 		if (data->ev_counter) return;
 
+		// timestamps are unwrapped by the parser, the difference
+		// stays valid when the retina's clock wraps around
 		uint64_t DVSTimestamp = dvs_ev->t;
 		uint64_t lastTimestamp = data->timestamps[dvs_ev->y][dvs_ev->x];
 		int64_t deltaT = DVSTimestamp - lastTimestamp;
@@ -44,16 +44,26 @@ void led_tracker_drive(
 		shared_ptr<DVSEvent> dvs_ev,
 		shared_ptr<SensorEvent> sensor_ev);
 
+/*
+ * batch user functions get a whole packet of events per call, see
+ * UserFunctionBatch
+ */
+void event_rate_batch(
+		RobotControl * const control,
+		const UserFunctionBatch &batch);
+
 
 /*
  * Add all the functions that you want to use to this list. Entries in this list
- * need to be of the form {"descriptive name", function_name}.
+ * need to be of the form {"descriptive name", function_name}, or of the form
+ * {"descriptive name", nullptr, batch_function_name}.
  */
 static const UserFunction user_functions[] = {
 	{"LED Tracker - motor", led_tracker_plain},
 	{"LED Tracker + motor", led_tracker_drive},
 	{"First demo function",  demo_function_1},
 	{"Second demo function", demo_function_2},
+	{"Event rate (batch)", nullptr, event_rate_batch},
 };
 
 
@@ -0,0 +1,173 @@
+#include "UserFunctionWorker.hpp"
+#include "RobotControl.hpp"
+#include "utils.hpp"
+
+#include <QMetaObject>
+#include <QTimer>
+
+namespace nst {
+
+UserFunctionWorker::
+UserFunctionWorker(RobotControl *ctrl, std::shared_ptr<LatencyStats> latency,
+		std::shared_ptr<RobotMetrics> metrics)
+: _ctrl(ctrl), _latency(latency), _metrics(metrics), _queue(QUEUE_CAPACITY)
+{
+	// the timer is a child, so it moves along into the worker's thread
+	_timer = new QTimer(this);
+	_timer->setInterval(TICK_INTERVAL_MS);
+	connect(_timer, &QTimer::timeout, this, &UserFunctionWorker::onTick);
+}
+
+
+UserFunctionWorker::
+~UserFunctionWorker()
+{ }
+
+
+bool UserFunctionWorker::
+pushPacket(const DVSEventPacketPtr &packet, uint64_t t_origin)
+{
+	return push({packet, std::shared_ptr<SensorEvent>(), t_origin});
+}
+
+
+bool UserFunctionWorker::
+pushSensorEvent(std::shared_ptr<SensorEvent> ev)
+{
+	return push({DVSEventPacketPtr(), ev, 0});
+}
+
+
+bool UserFunctionWorker::
+push(const message_t &msg)
+{
+	bool result = _queue.push(msg);
+	if (!_wakeup_pending.exchange(true))
+		QMetaObject::invokeMethod(this, "process", Qt::QueuedConnection);
+	return result;
+}
+
+
+void UserFunctionWorker::
+setUserFunction(const UserFunction *fn)
+{
+	// always go through the event loop, even from the worker's thread, as
+	// the user function that calls this still uses its user data
+	_next_fn.store(fn);
+	QMetaObject::invokeMethod(this, "applyUserFunction", Qt::QueuedConnection);
+}
+
+
+uint64_t UserFunctionWorker::
+origin() const
+{
+	return _t_origin;
+}
+
+
+uint64_t UserFunctionWorker::
+drops() const
+{
+	return _queue.drops();
+}
+
+
+void UserFunctionWorker::
+process()
+{
+	// acknowledge first, so that the producer will wake us up again if it
+	// pushes while we drain the queue
+	_wakeup_pending.store(false);
+
+	message_t msg;
+	while (_queue.pop(msg)) {
+		if (!_fn) continue;
+
+		// batch functions get sensor events along with the next packet
+		if (msg.sensor) {
+			if (_fn->batch_fn)
+				_sensors.push_back(*msg.sensor);
+			else {
+				const uint64_t t_start = monotonic_us();
+				_fn->fn(_ctrl, std::shared_ptr<DVSEvent>(), msg.sensor);
+				accountCalls(t_start, 1);
+			}
+			continue;
+		}
+
+		// commands of the user function are attributed to the oldest
+		// event
+		_t_origin = msg.t_origin;
+		if (_fn->batch_fn)
+			callBatch(msg.packet->data(), msg.packet->size());
+		else {
+			// hand out pointers that share ownership of the whole
+			// packet instead of allocating a new object for each event
+			const auto &packet = msg.packet;
+			std::shared_ptr<DVSEventPacket> owner(packet.get(), [packet](DVSEventPacket*) { });
+			const uint64_t t_start = monotonic_us();
+			for (auto &ev: *packet)
+				_fn->fn(_ctrl, std::shared_ptr<DVSEvent>(owner, &ev), std::shared_ptr<SensorEvent>());
+			accountCalls(t_start, packet->size());
+		}
+		if (_t_origin)
+			_latency->userfn.record(monotonic_us() - _t_origin);
+		_t_origin = 0;
+	}
+
+	// sensor events should not wait for the next packet or tick
+	if (_fn && _fn->batch_fn && !_sensors.empty())
+		callBatch(nullptr, 0);
+}
+
+
+void UserFunctionWorker::
+callBatch(const DVSEvent *events, size_t n)
+{
+	const UserFunctionBatch batch = {events, n, _sensors.data(), _sensors.size()};
+	const uint64_t t_start = monotonic_us();
+	_fn->batch_fn(_ctrl, batch);
+	accountCalls(t_start, 1);
+	_sensors.clear();
+}
+
+
+void UserFunctionWorker::
+accountCalls(uint64_t t_start, uint64_t calls)
+{
+	if (!_metrics) return;
+	RobotMetrics::add(_metrics->userfn_calls, calls);
+	RobotMetrics::add(_metrics->userfn_us, monotonic_us() - t_start);
+}
+
+
+void UserFunctionWorker::
+applyUserFunction()
+{
+	// release the user data of the previous function before the new one
+	// gets called
+	_ctrl->resetUserData();
+	_sensors.clear();
+	_fn = _next_fn.load();
+	if (_fn)
+		_timer->start();
+	else
+		_timer->stop();
+}
+
+
+void UserFunctionWorker::
+onTick()
+{
+	if (!_fn) return;
+	if (_fn->batch_fn)
+		callBatch(nullptr, 0);
+	else {
+		const uint64_t t_start = monotonic_us();
+		_fn->fn(_ctrl, std::shared_ptr<DVSEvent>(), std::shared_ptr<SensorEvent>());
+		accountCalls(t_start, 1);
+	}
+}
+
+
+} // nst::
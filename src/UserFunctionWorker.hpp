@@ -0,0 +1,124 @@
+#ifndef __USERFUNCTIONWORKER_HPP__C2A7E5D4_3B61_4F0E_9A4D_6E1F08B7C913
+#define __USERFUNCTIONWORKER_HPP__C2A7E5D4_3B61_4F0E_9A4D_6E1F08B7C913
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <QObject>
+#include "Datatypes.hpp"
+#include "EventPacketPool.hpp"
+#include "SPSCQueue.hpp"
+#include "LatencyHistogram.hpp"
+#include "RobotMetrics.hpp"
+
+// forward declarations
+class QTimer;
+
+namespace nst {
+
+// forward declarations
+class RobotControl;
+
+
+/**
+ * UserFunctionWorker - runs the user function of one robot in a thread of its
+ * own, so that a heavy user function does not stall the GUI and vice versa.
+ *
+ * Event packets and sensor events are handed over through a lock-free queue
+ * with exactly one producer, the thread of the RobotControl. Only one wakeup
+ * is pending at any time, the same scheme the BytestreamParser uses. The 15ms
+ * tick is generated by a timer in the worker's thread, so that it keeps
+ * running while the producer is busy.
+ *
+ * Batch user functions get each packet at once, together with the sensor
+ * events that were collected since their last call. Per-event user functions
+ * are fed from the same packets one event at a time.
+ *
+ * Every call of the user function is timed and added to the robot's metrics.
+ * Per-event user functions are timed per packet, which is then split up
+ * among the events.
+ *
+ * The user function and its user data are only touched from the worker's
+ * thread. Commands that the user function sends go to the connection, which
+ * accepts them from any thread.
+ */
+class UserFunctionWorker : public QObject
+{
+	Q_OBJECT
+
+public:
+	static constexpr size_t QUEUE_CAPACITY = 1024;
+	static constexpr int TICK_INTERVAL_MS = 15;
+
+	UserFunctionWorker(RobotControl *ctrl, std::shared_ptr<LatencyStats> latency,
+			std::shared_ptr<RobotMetrics> metrics);
+	virtual ~UserFunctionWorker();
+
+	/*
+	 * producer side, i.e. the thread of the RobotControl. t_origin is the
+	 * arrival time of the oldest event of the packet, or 0 if unknown.
+	 * Returns false if the queue was full and the data got dropped
+	 */
+	bool pushPacket(const DVSEventPacketPtr &packet, uint64_t t_origin);
+	bool pushSensorEvent(std::shared_ptr<SensorEvent> ev);
+
+	/*
+	 * select the user function. This can be called from any thread and
+	 * takes effect in the worker's thread, after the user data of the
+	 * previous function was released. nullptr stops the user function
+	 */
+	void setUserFunction(const UserFunction *fn);
+
+	/*
+	 * arrival time of the data that the user function currently works on.
+	 * Only meaningful in the worker's thread
+	 */
+	uint64_t origin() const;
+
+	uint64_t drops() const;
+
+private slots:
+	void process();
+	void applyUserFunction();
+	void onTick();
+
+private:
+	typedef struct {
+		DVSEventPacketPtr packet;
+		std::shared_ptr<SensorEvent> sensor;
+		uint64_t t_origin;
+	} message_t;
+
+	bool push(const message_t &msg);
+
+	/*
+	 * call the batch user function with the given events and all pending
+	 * sensor events
+	 */
+	void callBatch(const DVSEvent *events, size_t n);
+
+	/*
+	 * add calls of the user function that started at t_start to the
+	 * metrics
+	 */
+	void accountCalls(uint64_t t_start, uint64_t calls);
+
+	RobotControl *_ctrl;
+	std::shared_ptr<LatencyStats> _latency;
+	std::shared_ptr<RobotMetrics> _metrics;
+
+	SPSCQueue<message_t> _queue;
+	std::atomic<bool> _wakeup_pending{false};
+	std::atomic<const UserFunction*> _next_fn{nullptr};
+
+	// only used in the worker's thread
+	QTimer *_timer = nullptr;
+	const UserFunction *_fn = nullptr;
+	uint64_t _t_origin = 0;
+	std::vector<SensorEvent> _sensors;
+};
+
+
+} // nst::
+
+#endif /* __USERFUNCTIONWORKER_HPP__C2A7E5D4_3B61_4F0E_9A4D_6E1F08B7C913 */
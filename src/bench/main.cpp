@@ -0,0 +1,552 @@
+/*
+ * pbrc_bench - microbenchmarks for the hot paths of the robot control.
+ *
+ * The parser is fed with synthetic streams in all time formats, and with
+ * recordings that are given on the command line. The IMU decoders and the
+ * command serializers are measured as well. Allocations are counted through
+ * the global operator new, i.e. they do not include the malloc-based storage
+ * of Qt's containers.
+ *
+ * With --serial, QSerialPort and the native LinuxSerialPort read from a
+ * pseudo terminal, which stands in for the FTDI adapter of a robot.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <thread>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QCommandLineOption>
+#include <QFile>
+#include <QObject>
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QEventLoop>
+#include <QTimer>
+#include <QSerialPort>
+#include "Datatypes.hpp"
+#include "BytestreamParser.hpp"
+#include "SensorsProcessor.hpp"
+#include "StreamRecording.hpp"
+#include "Commands.hpp"
+#include "LinuxSerialPort.hpp"
+#include "utils.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+using namespace nst;
+
+typedef std::chrono::steady_clock bench_clock;
+
+
+/*
+ * count all allocations that go through operator new
+ */
+static std::atomic<uint64_t> allocations{0};
+
+void*
+operator new(size_t n)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = std::malloc(n ? n : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void
+operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept
+{
+	std::free(p);
+}
+
+
+/*
+ * the p-th percentile of a set of samples
+ */
+static double
+percentile(std::vector<double> &samples, double p)
+{
+	if (samples.empty()) return 0.0;
+	size_t k = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+	std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+	return samples[k];
+}
+
+static const struct {
+	DVSEvent::timeformat_t fmt;
+	const char *name;
+	unsigned timestamp_bytes;
+} timeformats[] = {
+	{DVSEvent::TIMEFORMAT_0BYTES, "TIMEFORMAT_0BYTES", 0},
+	{DVSEvent::TIMEFORMAT_2BYTES, "TIMEFORMAT_2BYTES", 2},
+	{DVSEvent::TIMEFORMAT_3BYTES, "TIMEFORMAT_3BYTES", 3},
+	{DVSEvent::TIMEFORMAT_4BYTES, "TIMEFORMAT_4BYTES", 4},
+};
+
+
+/*
+ * generate a bytestream as the eDVS would send it. events have increasing
+ * timestamps (1us apart), and every 1000 events there is an IMU response line
+ */
+static QByteArray
+synthetic_stream(unsigned timestamp_bytes, size_t nevents)
+{
+	const char *imu_line = "-S10 0000FFFF 00010000 FFFF0000\n";
+	QByteArray stream;
+	stream.reserve(nevents * (2 + timestamp_bytes) + (nevents / 1000 + 1) * 32);
+
+	uint32_t seed = 42;
+	for (size_t i = 0; i < nevents; i++) {
+		seed = seed * 1103515245u + 12345u;
+		stream.append(static_cast<char>(0x80 | ((seed >> 8) & 0x7F)));
+		stream.append(static_cast<char>((seed >> 16) & 0xFF));
+		for (unsigned b = timestamp_bytes; b > 0; b--)
+			stream.append(static_cast<char>((i >> (8 * (b - 1))) & 0xFF));
+
+		if (i % 1000 == 999)
+			stream.append(imu_line, 32);
+	}
+	return stream;
+}
+
+
+/*
+ * split a stream into chunks of the size the socket usually delivers
+ */
+static std::vector<QByteArray>
+split_stream(const QByteArray &stream, int chunk_size)
+{
+	std::vector<QByteArray> chunks;
+	for (int off = 0; off < stream.size(); off += chunk_size)
+		chunks.push_back(stream.mid(off, std::min(chunk_size, stream.size() - off)));
+	return chunks;
+}
+
+
+/*
+ * read the chunks of a recording, exactly as they arrived from the robot
+ */
+static bool
+load_recording(const QString &path, std::vector<QByteArray> &chunks)
+{
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly)) {
+		std::cerr << "EE: Could not open recording " << path.toStdString() << std::endl;
+		return false;
+	}
+	const QByteArray data = file.readAll();
+
+	StreamRecordingHeader hdr;
+	if (static_cast<size_t>(data.size()) < sizeof(hdr)) {
+		std::cerr << "EE: " << path.toStdString() << " is not a recording" << std::endl;
+		return false;
+	}
+	std::memcpy(&hdr, data.constData(), sizeof(hdr));
+	if (std::memcmp(hdr.magic, STREAM_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != StreamRecordingHeader::VERSION) {
+		std::cerr << "EE: " << path.toStdString() << " is not a recording" << std::endl;
+		return false;
+	}
+
+	// a truncated chunk at the end is ignored
+	size_t off = sizeof(hdr);
+	while (off + STREAM_CHUNK_HEADER_SIZE <= static_cast<size_t>(data.size())) {
+		uint32_t len;
+		std::memcpy(&len, data.constData() + off + sizeof(uint64_t), sizeof(len));
+		off += STREAM_CHUNK_HEADER_SIZE;
+		if (off + len > static_cast<size_t>(data.size())) break;
+		chunks.push_back(data.mid(static_cast<int>(off), static_cast<int>(len)));
+		off += len;
+	}
+	return true;
+}
+
+
+/*
+ * feed chunks through the parser and drain the event queue after each chunk,
+ * as the robot control would do
+ */
+static void
+bench_parser(DVSEvent::timeformat_t fmt, const std::string &name, const std::vector<QByteArray> &chunks)
+{
+	constexpr unsigned REPETITIONS = 10;
+
+	BytestreamParser parser(0, fmt);
+	QObject::connect(&parser, &BytestreamParser::responseReceived, [](QString *str) { delete str; });
+
+	auto *queue = parser.eventQueue();
+	std::vector<DVSEvent> sink(queue->capacity());
+	std::vector<double> chunk_ns;
+	chunk_ns.reserve(chunks.size() * REPETITIONS);
+	size_t nevents = 0;
+	double bytes = 0.0;
+
+	const uint64_t allocs = allocations.load();
+	auto t0 = bench_clock::now();
+	for (unsigned r = 0; r < REPETITIONS; r++) {
+		for (const auto &chunk: chunks) {
+			auto tc = bench_clock::now();
+			parser.parseData(chunk.constData(), chunk.size());
+			nevents += queue->pop(sink.data(), sink.size());
+			chunk_ns.push_back(std::chrono::duration<double, std::nano>(bench_clock::now() - tc).count());
+			bytes += chunk.size();
+		}
+	}
+	auto t1 = bench_clock::now();
+	const uint64_t nallocs = allocations.load() - allocs;
+
+	double secs = std::chrono::duration<double>(t1 - t0).count();
+	std::cout << "parser " << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(10) << bytes / secs / 1e6 << " MB/s"
+		<< std::setw(10) << nevents / secs / 1e6 << " Mev/s"
+		<< std::setprecision(4)
+		<< std::setw(10) << (nevents ? static_cast<double>(nallocs) / nevents : 0.0) << " allocs/ev"
+		<< std::setprecision(1)
+		<< std::setw(10) << percentile(chunk_ns, 0.99) / 1e3 << " us/chunk p99"
+		<< std::endl;
+}
+
+
+/*
+ * decode IMU lines with the legacy QString path (split and decodeSensorVal per
+ * axis) and with decodeSensorLine straight from the bytes
+ */
+static void
+bench_imu_decoder()
+{
+	constexpr size_t NLINES = 1 << 18;
+	const char *lines[] = {
+		"-S10 0000FFFF 00010000 FFFF0000",
+		"-S11 FFFE8000 00000123 7FFFFFFF",
+		"-S12 00A0B0C0 FFFFFFFF 80000000",
+	};
+	double sum = 0.0;
+
+	auto t0 = bench_clock::now();
+	for (size_t i = 0; i < NLINES; i++) {
+		const QString str = QString::fromLatin1(lines[i % LENGTH(lines)]);
+		const QStringList axes = str.right(str.length() - 5).split(" ");
+		for (int axis = 0; axis < 3 && axis < axes.size(); axis++)
+			sum += decodeSensorVal(axes[axis]);
+	}
+	auto t1 = bench_clock::now();
+
+	IMUSample sample;
+	for (size_t i = 0; i < NLINES; i++) {
+		const char *line = lines[i % LENGTH(lines)];
+		decodeSensorLine(line, std::strlen(line), sample);
+		sum -= sample.v[0] + sample.v[1] + sample.v[2];
+	}
+	auto t2 = bench_clock::now();
+
+	double legacy = std::chrono::duration<double, std::nano>(t1 - t0).count() / NLINES;
+	double fast = std::chrono::duration<double, std::nano>(t2 - t1).count() / NLINES;
+	std::cout << "imu    " << std::left << std::setw(20) << "decodeSensorVal" << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(10) << legacy << " ns/line" << std::endl;
+	std::cout << "imu    " << std::left << std::setw(20) << "decodeSensorLine" << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(10) << fast << " ns/line" << std::endl;
+
+	// both paths have to agree
+	if (std::abs(sum) > 1e-6)
+		std::cerr << "EE: IMU decoders disagree (" << sum << ")" << std::endl;
+}
+
+
+/*
+ * complete sensor lines through SensorsProcessor::parseString, which is what
+ * responses from the robot go through
+ */
+static void
+bench_parse_string()
+{
+	constexpr size_t NLINES = 1 << 18;
+	const QString lines[] = {
+		QString::fromLatin1("-S10 0000FFFF 00010000 FFFF0000"),
+		QString::fromLatin1("-S11 FFFE8000 00000123 7FFFFFFF"),
+		QString::fromLatin1("-S12 00A0B0C0 FFFFFFFF 80000000"),
+	};
+	SensorsProcessor sensors;
+	size_t parsed = 0;
+
+	const uint64_t allocs = allocations.load();
+	auto t0 = bench_clock::now();
+	for (size_t i = 0; i < NLINES; i++)
+		parsed += sensors.parseString(&lines[i % LENGTH(lines)]);
+	auto t1 = bench_clock::now();
+	const uint64_t nallocs = allocations.load() - allocs;
+
+	std::cout << "imu    " << std::left << std::setw(20) << "parseString" << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(10) << std::chrono::duration<double, std::nano>(t1 - t0).count() / NLINES << " ns/line"
+		<< std::setprecision(2)
+		<< std::setw(10) << static_cast<double>(nallocs) / NLINES << " allocs/line"
+		<< std::endl;
+
+	if (parsed != NLINES)
+		std::cerr << "EE: parseString rejected " << NLINES - parsed << " lines" << std::endl;
+}
+
+
+/*
+ * serialize a command repeatedly, and check that the result matches the
+ * string representation
+ */
+template <typename CMD>
+static void
+bench_command(const char *name, const CMD &cmd)
+{
+	constexpr size_t NCOMMANDS = 1 << 20;
+	char buf[commands::COMMAND_MAX_LENGTH];
+	size_t total = 0;
+
+	const uint64_t allocs = allocations.load();
+	auto t0 = bench_clock::now();
+	for (size_t i = 0; i < NCOMMANDS; i++)
+		total += cmd.serialize(buf, sizeof(buf));
+	auto t1 = bench_clock::now();
+	const uint64_t nallocs = allocations.load() - allocs;
+
+	std::cout << "cmd    " << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(10) << std::chrono::duration<double, std::nano>(t1 - t0).count() / NCOMMANDS << " ns/cmd"
+		<< std::setprecision(2)
+		<< std::setw(10) << static_cast<double>(nallocs) / NCOMMANDS << " allocs/cmd"
+		<< std::endl;
+
+	const size_t n = total / NCOMMANDS;
+	if (n > sizeof(buf) || std::string(buf, n) != cmd.toString())
+		std::cerr << "EE: serialize() of " << name << " does not match toString()" << std::endl;
+}
+
+
+static void
+bench_commands()
+{
+	using namespace commands;
+	bench_command("MotorDriver", MotorDriver(true));
+	bench_command("DVS", DVS(true));
+	bench_command("IMU", IMU(true));
+	bench_command("LED", LED(1000, 0.5f, 0.25f));
+	bench_command("LaserPointer", LaserPointer(500, 0.5f));
+	bench_command("Buzzer", Buzzer(440, 0.5f));
+	bench_command("BoardLED", BoardLED(BoardLED::LED_MODE_BLINKING));
+	bench_command("Empty", Empty());
+	bench_command("CommandString", CommandString("!M+"));
+	bench_command("MotorCommand", MVD0(-42));
+}
+
+#ifdef __linux__
+
+/*
+ * write to the master side of a pty from another thread while the port reads
+ * the slave side in the event loop. Without latency, the writer pushes data as
+ * fast as it can. With latency, it sends small blocks at a fixed rate that
+ * start with their send time, and the delay until readyRead() handed them out
+ * is collected
+ */
+template <typename PORT>
+static bool
+run_serial_phase(PORT *port, int master, bool latency, double &mbps, std::vector<double> &delays)
+{
+	constexpr size_t THROUGHPUT_BYTES = 32 << 20;
+	constexpr size_t BLOCK_SIZE = 64;
+	constexpr size_t LATENCY_BLOCKS = 2000;
+	constexpr unsigned LATENCY_INTERVAL_US = 500;
+	constexpr int TIMEOUT_MS = 30000;
+
+	const size_t total = latency ? LATENCY_BLOCKS * BLOCK_SIZE : THROUGHPUT_BYTES;
+	size_t received = 0;
+	size_t pos = 0;
+	char header[sizeof(uint64_t)];
+
+	QEventLoop loop;
+	// the connection goes away along with the loop
+	QObject::connect(port, &PORT::readyRead, &loop, [&] {
+		const QByteArray data = port->readAll();
+		const uint64_t now = monotonic_us();
+		if (latency) {
+			for (char c: data) {
+				if (pos < sizeof(header)) header[pos] = c;
+				if (++pos == BLOCK_SIZE) {
+					uint64_t t_send;
+					std::memcpy(&t_send, header, sizeof(t_send));
+					delays.push_back(static_cast<double>(now - t_send));
+					pos = 0;
+				}
+			}
+		}
+		received += data.size();
+		if (received >= total) loop.quit();
+	});
+	QTimer::singleShot(TIMEOUT_MS, &loop, &QEventLoop::quit);
+
+	// the master is non-blocking, so that the writer can give up if the
+	// reader stalls
+	std::atomic<bool> stop{false};
+	std::thread writer([&] {
+		std::vector<char> buf(latency ? BLOCK_SIZE : 4096, 'x');
+		size_t sent = 0;
+		auto t_next = bench_clock::now();
+		while (sent < total && !stop.load()) {
+			if (latency) {
+				std::this_thread::sleep_until(t_next);
+				t_next += std::chrono::microseconds(LATENCY_INTERVAL_US);
+				const uint64_t t_send = monotonic_us();
+				std::memcpy(buf.data(), &t_send, sizeof(t_send));
+			}
+			size_t off = 0;
+			while (off < buf.size() && !stop.load()) {
+				ssize_t n = ::write(master, buf.data() + off, buf.size() - off);
+				if (n > 0)
+					off += n;
+				else {
+					struct pollfd pfd = {master, POLLOUT, 0};
+					poll(&pfd, 1, 10);
+				}
+			}
+			sent += off;
+		}
+	});
+
+	auto t0 = bench_clock::now();
+	loop.exec();
+	auto t1 = bench_clock::now();
+	stop.store(true);
+	writer.join();
+
+	mbps = received / std::chrono::duration<double>(t1 - t0).count() / 1e6;
+	if (received < total) {
+		std::cerr << "EE: Serial benchmark timed out after " << received << " of " << total << " bytes" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+
+template <typename PORT>
+static void
+bench_serial_port(const char *name, PORT *port, int master)
+{
+	double mbps, ignored;
+	std::vector<double> delays;
+	if (!run_serial_phase(port, master, false, mbps, delays)) return;
+	if (!run_serial_phase(port, master, true, ignored, delays)) return;
+
+	std::cout << "serial " << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(10) << mbps << " MB/s"
+		<< std::setw(10) << percentile(delays, 0.5) << " us p50"
+		<< std::setw(10) << percentile(delays, 0.99) << " us p99"
+		<< std::endl;
+}
+
+
+static void
+bench_serial()
+{
+	constexpr int BAUDRATE = 12000000;
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		std::cerr << "EE: Could not create a pseudo terminal" << std::endl;
+		if (master >= 0) ::close(master);
+		return;
+	}
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	const QString path = QString::fromLocal8Bit(ptsname(master));
+
+	QSerialPort serial;
+	serial.setPortName(path);
+	serial.setBaudRate(BAUDRATE);
+	if (serial.open(QIODevice::ReadWrite)) {
+		bench_serial_port("QSerialPort", &serial, master);
+		serial.close();
+	}
+	else
+		std::cerr << "EE: Could not open " << path.toStdString() << ": " << serial.errorString().toStdString() << std::endl;
+
+	LinuxSerialPort native;
+	if (native.open(path, BAUDRATE)) {
+		bench_serial_port("LinuxSerialPort", &native, master);
+		native.close();
+	}
+	else
+		std::cerr << "EE: Could not open " << path.toStdString() << ": " << native.errorString().toStdString() << std::endl;
+
+	::close(master);
+}
+
+#else
+
+static void
+bench_serial()
+{
+	std::cerr << "EE: The serial benchmark needs Linux" << std::endl;
+}
+
+#endif
+
+
+int
+main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("pbrc_bench");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Microbenchmarks of the parser, IMU decoders and command serializers");
+	parser.addHelpOption();
+	parser.addPositionalArgument("recording", "Recordings to feed through the parser in addition to synthetic streams.", "recording...");
+	QCommandLineOption bytesOption({"t", "timestamp-bytes"}, "Timestamp bytes per event in the recordings (0, 2, 3 or 4).", "n", "3");
+	parser.addOption(bytesOption);
+	QCommandLineOption serialOption("serial", "Compare QSerialPort and the native serial backend on a pseudo terminal.");
+	parser.addOption(serialOption);
+	parser.process(app);
+
+	constexpr size_t NEVENTS = 1 << 20;
+	constexpr int CHUNK_SIZE = 4096;
+	for (size_t i = 0; i < LENGTH(timeformats); i++) {
+		const auto chunks = split_stream(synthetic_stream(timeformats[i].timestamp_bytes, NEVENTS), CHUNK_SIZE);
+		bench_parser(timeformats[i].fmt, timeformats[i].name, chunks);
+	}
+
+	const unsigned timestamp_bytes = parser.value(bytesOption).toUInt();
+	for (const auto &path: parser.positionalArguments()) {
+		const auto *tf = std::find_if(std::begin(timeformats), std::end(timeformats),
+				[timestamp_bytes](decltype(timeformats[0]) &t) { return t.timestamp_bytes == timestamp_bytes; });
+		if (tf == std::end(timeformats)) {
+			std::cerr << "EE: Invalid number of timestamp bytes " << timestamp_bytes << std::endl;
+			return 1;
+		}
+
+		std::vector<QByteArray> chunks;
+		if (!load_recording(path, chunks))
+			return 1;
+		bench_parser(tf->fmt, path.toStdString(), chunks);
+	}
+
+	bench_imu_decoder();
+	bench_parse_string();
+	bench_commands();
+	if (parser.isSet(serialOption))
+		bench_serial();
+
+	return 0;
+}
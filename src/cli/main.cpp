@@ -0,0 +1,236 @@
+/*
+ * pbrc-run - run user functions on one or more robots without a GUI, and
+ * print throughput statistics
+ */
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QCommandLineOption>
+#include <QString>
+#include <QTimer>
+#include "RobotControl.hpp"
+#include "RCManager.hpp"
+#include "IOReactor.hpp"
+#include "UserFunction.hpp"
+#include "Commands.hpp"
+#include "utils.hpp"
+
+using namespace nst;
+
+/*
+ * counters of one robot since the last report
+ */
+struct robot_stats_t
+{
+	QString uri;
+	std::unique_ptr<RobotControl> control;
+	uint64_t events = 0;
+	uint64_t packets = 0;
+	uint64_t sensor_events = 0;
+	uint64_t responses = 0;
+	uint64_t drops = 0;
+
+	// metrics at the last report
+	RobotMetricsSnapshot metrics;
+};
+
+
+static void
+list_user_functions()
+{
+	for (size_t i = 0; i < LENGTH(user_functions); i++)
+		std::cout << i << ": " << user_functions[i].name << std::endl;
+}
+
+
+/*
+ * look up a user function by name or by its index in user_functions[]
+ */
+static const UserFunction*
+find_user_function(const QString &name)
+{
+	for (size_t i = 0; i < LENGTH(user_functions); i++)
+		if (name == user_functions[i].name) return &user_functions[i];
+
+	bool ok;
+	unsigned idx = name.toUInt(&ok);
+	if (ok && idx < LENGTH(user_functions)) return &user_functions[idx];
+	return nullptr;
+}
+
+
+static void
+print_stats(std::vector<std::unique_ptr<robot_stats_t>> &robots, double secs)
+{
+	uint64_t total = 0;
+	for (auto &r: robots) {
+		const uint64_t drops = r->control->eventQueueDrops();
+		std::cout << "robot " << std::setw(3) << static_cast<unsigned>(r->control->id())
+			<< " " << std::left << std::setw(24) << r->uri.toStdString() << std::right << std::fixed << std::setprecision(1)
+			<< (r->control->isConnected() ? "  up  " : " down ")
+			<< std::setw(10) << r->events / secs / 1e3 << " kev/s"
+			<< std::setw(8) << r->packets / secs << " pkt/s"
+			<< std::setw(8) << r->sensor_events / secs << " imu/s"
+			<< std::setw(6) << r->responses << " resp"
+			<< std::setw(8) << drops - r->drops << " drops"
+			<< std::setw(8) << r->control->eventQueueHighWaterMark() << " hwm"
+			<< std::endl;
+
+		// latencies since the start, p50/p99/max in microseconds
+		const auto &lat = r->control->latencyStats();
+		const struct { const char *name; const LatencyHistogram &h; } stages[] = {
+			{"decode", lat.decode}, {"deliver", lat.deliver}, {"userfn", lat.userfn}, {"command", lat.command}, {"stop", lat.stop},
+		};
+		std::cout << "         latency us p50/p99/max:";
+		for (const auto &s: stages)
+			std::cout << " " << s.name << " " << s.h.percentile(0.5) << "/" << s.h.percentile(0.99) << "/" << s.h.max();
+		std::cout << std::endl;
+
+		// where the time goes: link, parser, queues and user function
+		const auto m = r->control->metrics();
+		const auto &p = r->metrics;
+		std::cout << "         in " << m.rate(p, &RobotMetricsSnapshot::bytes_received) / 1e6 << " MB/s"
+			<< " decoded " << m.rate(p, &RobotMetricsSnapshot::events_decoded) / 1e3 << " kev/s"
+			<< " imu " << m.rate(p, &RobotMetricsSnapshot::imu_samples) << "/s"
+			<< " resp " << m.responses - p.responses
+			<< " resyncs " << m.resyncs - p.resyncs
+			<< " queue " << m.event_queue_depth << "/" << m.event_queue_capacity
+			<< " | out " << m.rate(p, &RobotMetricsSnapshot::commands_sent) << " cmd/s"
+			<< " " << m.rate(p, &RobotMetricsSnapshot::bytes_written) << " B/s"
+			<< " | userfn " << m.userfnTimePerCall(p) << " us/call " << m.userfnLoad(p) * 100 << "% busy"
+			<< " | rx stalls " << m.receive_buffer_exhausted - p.receive_buffer_exhausted
+			<< " drops in " << m.input_drops - p.input_drops
+			<< " ev " << m.event_queue_drops - p.event_queue_drops
+			<< " uf " << m.userfn_drops - p.userfn_drops
+			<< std::endl;
+		r->metrics = m;
+
+		total += r->events;
+		r->events = r->packets = r->sensor_events = r->responses = 0;
+		r->drops = drops;
+	}
+	if (robots.size() > 1)
+		std::cout << "total " << std::fixed << std::setprecision(1) << total / secs / 1e3 << " kev/s" << std::endl;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	// same registration as for the GUI, commands are passed along as
+	// pointers to the base class
+	qRegisterMetaType<uint16_t>("uint16_t");
+	qRegisterMetaType<commands::Command*>("commands::Command*");
+	qRegisterMetaType<const commands::Command*>("const commands::Command*");
+
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("pbrc-run");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Run user functions on PushBots without a GUI");
+	parser.addHelpOption();
+	parser.addPositionalArgument("uri", "IP address, serial port (/dev/ttyUSB0?baudrate=12000000) or recording (file?replay=1) of a robot.", "uri...");
+	QCommandLineOption functionOption({"f", "function"}, "Name or index of the user function to run.", "name");
+	QCommandLineOption listOption({"l", "list"}, "List all user functions.");
+	QCommandLineOption portOption({"p", "port"}, "TCP port of network robots.", "port", "56000");
+	QCommandLineOption intervalOption({"i", "interval"}, "Seconds between two reports.", "secs", "1");
+	QCommandLineOption durationOption({"d", "duration"}, "Stop after this many seconds, 0 runs until interrupted.", "secs", "0");
+	QCommandLineOption hostTimeOption("host-time", "Map event timestamps onto the host's monotonic clock.");
+	QCommandLineOption ioThreadsOption("io-threads", "Threads that serve the connections of all robots.", "n", QString::number(rcman_reactor().ioThreads()));
+	QCommandLineOption parseThreadsOption("parse-threads", "Threads that parse the data of all robots.", "n", QString::number(rcman_reactor().parseThreads()));
+	parser.addOption(functionOption);
+	parser.addOption(listOption);
+	parser.addOption(portOption);
+	parser.addOption(intervalOption);
+	parser.addOption(durationOption);
+	parser.addOption(hostTimeOption);
+	parser.addOption(ioThreadsOption);
+	parser.addOption(parseThreadsOption);
+	parser.process(app);
+
+	if (parser.isSet(listOption)) {
+		list_user_functions();
+		return 0;
+	}
+
+	const QStringList uris = parser.positionalArguments();
+	if (uris.isEmpty()) {
+		std::cerr << "EE: No robot given" << std::endl;
+		parser.showHelp(1);
+	}
+
+	const UserFunction *userfn = nullptr;
+	if (parser.isSet(functionOption)) {
+		userfn = find_user_function(parser.value(functionOption));
+		if (!userfn) {
+			std::cerr << "EE: Unknown user function " << parser.value(functionOption).toStdString() << std::endl;
+			list_user_functions();
+			return 1;
+		}
+	}
+
+	const uint16_t port = parser.value(portOption).toUShort();
+	const double interval = std::max(0.1, parser.value(intervalOption).toDouble());
+	const double duration = parser.value(durationOption).toDouble();
+	rcman_reactor().setThreadCounts(parser.value(ioThreadsOption).toUInt(), parser.value(parseThreadsOption).toUInt());
+
+	std::vector<std::unique_ptr<robot_stats_t>> robots;
+	for (const auto &uri: uris) {
+		auto r = std::make_unique<robot_stats_t>();
+		auto *stats = r.get();
+		r->uri = uri;
+		r->control = std::make_unique<RobotControl>();
+		r->metrics = r->control->metrics();
+
+		auto *ctrl = r->control.get();
+		QObject::connect(ctrl, &RobotControl::DVSEventPacketReceived, [stats](const DVSEventPacketPtr &packet) {
+			stats->events += packet->size();
+			stats->packets++;
+		});
+		QObject::connect(ctrl, &RobotControl::sensorEvent, [stats](std::shared_ptr<SensorEvent>) {
+			stats->sensor_events++;
+		});
+		QObject::connect(ctrl, &RobotControl::responseReceived, [stats](std::shared_ptr<QString>) {
+			stats->responses++;
+		});
+
+		// nobody displays the data that user functions hand out, but it
+		// still needs to be released
+		QObject::connect(ctrl, &RobotControl::userFunctionData, [](uint8_t, int type, void *data) {
+			if (type == UFDT_LED_TRACKING_INFO)
+				delete static_cast<led_tracking_info*>(data);
+		});
+		QObject::connect(ctrl, &RobotControl::connected, [stats]{
+			std::cout << "II: connected to " << stats->uri.toStdString() << std::endl;
+		});
+		QObject::connect(ctrl, &RobotControl::disconnected, [stats]{
+			std::cout << "II: disconnected from " << stats->uri.toStdString() << std::endl;
+		});
+
+		if (parser.isSet(hostTimeOption))
+			ctrl->setTimestampMode(DVSEvent::TIMESTAMP_HOST);
+		if (userfn)
+			ctrl->setUserFunction(userfn);
+		ctrl->connectRobot(uri, port);
+		robots.push_back(std::move(r));
+	}
+
+	QTimer report;
+	QObject::connect(&report, &QTimer::timeout, [&robots, interval]{
+		print_stats(robots, interval);
+	});
+	report.start(static_cast<int>(interval * 1000));
+
+	if (duration > 0.0)
+		QTimer::singleShot(static_cast<int>(duration * 1000), &app, &QCoreApplication::quit);
+
+	int result = app.exec();
+
+	for (auto &r: robots)
+		r->control->disconnectRobot();
+	return result;
+}
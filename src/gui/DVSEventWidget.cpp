@@ -2,6 +2,11 @@
 #include "DVSEventWidget.hpp"
 #include <QRect>
 #include <QPainter>
+#include <QPen>
+#include <QColor>
+#include <QPointF>
+#include <algorithm>
+#include <cmath>
 #include "Datatypes.hpp"
 
 namespace nst { namespace gui {
@@ -10,12 +15,17 @@ namespace nst { namespace gui {
 DVSEventWidget::
 DVSEventWidget(QWidget *parent) : QWidget(parent), _track_x(-1), _track_y(-1)
 {
-	_image = new QImage(128, 128, QImage::Format_RGB32);
-	_decay_factor = 0.80;
+	_image = new QImage(DVS_SIZE, DVS_SIZE, QImage::Format_RGB32);
+	_image->fill(qRgb(0, 0, 0));
+	for (unsigned i = 0; i < DVS_SIZE * DVS_SIZE; i++) {
+		_pixel_color[i] = qRgb(0, 0, 0);
+		_pixel_time[i] = 0;
+	}
+	setDecayFactor(0.80);
 
-	connect(&_timer, &QTimer::timeout, this, &DVSEventWidget::decayImage);
-	_timer.setInterval(20);
-	_timer.start();
+	// only runs while there is something to fade
+	connect(&_timer, &QTimer::timeout, this, &DVSEventWidget::onRefreshTimeout);
+	setMaxFPS(DEFAULT_MAX_FPS);
 }
 
 
@@ -29,65 +39,130 @@ DVSEventWidget::
 void DVSEventWidget::
 setDecayFactor(float decay_factor)
 {
-	_decay_factor = decay_factor;
+	_decay_factor = clamp(decay_factor, 0.0f, 0.99f);
+
+	// the factor applies per refresh interval, the table has a finer
+	// resolution so that fading is smooth
+	const double per_step = std::pow(static_cast<double>(_decay_factor),
+			static_cast<double>(DECAY_STEP_US) / (DECAY_INTERVAL_MS * 1000.0));
+	_decay_lut.clear();
+	double f = 256.0;
+	while (f >= 1.0) {
+		_decay_lut.push_back(static_cast<uint16_t>(f));
+		f *= per_step;
+	}
+	update();
 }
 
 
 void DVSEventWidget::
-decayPixel(unsigned *p)
+setMaxFPS(unsigned fps)
 {
-	*p = qRgb(qRed(*p) * _decay_factor,
-		  qGreen(*p) * _decay_factor,
-		  qBlue(*p) * _decay_factor);
+	_timer.setInterval(1000 / clamp(fps, 1u, 1000u));
 }
 
 
 void DVSEventWidget::
-decayImage()
+renderImage(uint64_t now)
+{
+	const uint64_t nsteps = _decay_lut.size();
+	for (unsigned y = 0; y < DVS_SIZE; y++) {
+		QRgb *line = reinterpret_cast<QRgb*>(_image->scanLine(y));
+		const QRgb *color = _pixel_color + y * DVS_SIZE;
+		const uint64_t *time = _pixel_time + y * DVS_SIZE;
+
+		for (unsigned x = 0; x < DVS_SIZE; x++) {
+			const uint64_t step = (now - time[x]) / DECAY_STEP_US;
+			if (step >= nsteps) {
+				line[x] = qRgb(0, 0, 0);
+				continue;
+			}
+			const unsigned f = _decay_lut[step];
+			const QRgb c = color[x];
+			line[x] = qRgb((qRed(c) * f) >> 8, (qGreen(c) * f) >> 8, (qBlue(c) * f) >> 8);
+		}
+	}
+}
+
+
+void DVSEventWidget::
+drawTrackingLine(QPainter &p, const QRect &rect)
+{
+	if (_track_x < 0 || _track_y < 0) return;
+
+	// through the center of the tracked pixel, one pixel wide
+	const qreal sx = static_cast<qreal>(rect.width()) / DVS_SIZE;
+	const qreal sy = static_cast<qreal>(rect.height()) / DVS_SIZE;
+	const qreal x = (_track_x + 0.5) * sx;
+	const qreal y = (_track_y + 0.5) * sy;
+
+	QPen pen(QColor(0, 255, 0));
+	pen.setWidthF(std::max<qreal>(1.0, std::min(sx, sy)));
+	p.setPen(pen);
+	p.drawLine(QPointF(x, 0), QPointF(x, rect.height()));
+	p.drawLine(QPointF(0, y), QPointF(rect.width(), y));
+}
+
+
+void DVSEventWidget::
+onRefreshTimeout()
 {
-	unsigned *bits = (unsigned*)_image->bits();
-	unsigned N = _image->width() * _image->height();
-	for (unsigned i = 0; i < N; i++)
-		decayPixel(bits++);
 	update();
+
+	// everything faded to black, nothing to do until new events arrive
+	if ((monotonic_us() - _t_newest) / DECAY_STEP_US >= _decay_lut.size())
+		_timer.stop();
 }
 
 
 void DVSEventWidget::
 paintEvent(QPaintEvent * /*event*/)
 {
+	renderImage(monotonic_us());
+
 	QPainter p(this);
 	QRect rect(0, 0, geometry().width(), geometry().height());
 	p.drawImage(rect, *_image);
+	drawTrackingLine(p, rect);
+}
+
+
+void DVSEventWidget::
+setPixel(unsigned x, unsigned y, QRgb color, uint64_t t)
+{
+	if (x >= DVS_SIZE || y >= DVS_SIZE) return;
+	const unsigned i = y * DVS_SIZE + x;
+	_pixel_color[i] = color;
+	_pixel_time[i] = t;
 }
 
 
 void DVSEventWidget::
-newEvent(std::shared_ptr<DVSEvent> ev)
+newEvents(const DVSEventPacketPtr &packet)
 {
 	constexpr QRgb COLOR_ON = qRgb(0, 0, 255);
 	constexpr QRgb COLOR_OFF = qRgb(255, 0, 0);
-	constexpr QRgb COLOR_TRACK = qRgb(0, 255, 0);
-
-	// TODO: check if this function is called too often. If so,
-	// accumulate events to stop updating the image too frequently
-	_image->setPixel(ev->y, ev->x, ev->p ? COLOR_ON : COLOR_OFF);
-
-	// tracking information
-	if (_track_x >= 0 && _track_y >= 0) {
-		for (int x = 0; x < 128; ++x)
-			_image->setPixel(x, _track_y, COLOR_TRACK);
-		for (int y = 0; y < 128; ++y)
-			_image->setPixel(_track_x, y, COLOR_TRACK);
-	}
+
+	// all events of a packet arrived at the same time as far as the
+	// display is concerned. The image itself is only rendered when the
+	// timer triggers a repaint
+	const uint64_t now = monotonic_us();
+	for (const auto &ev: *packet)
+		setPixel(ev.y, ev.x, ev.p ? COLOR_ON : COLOR_OFF, now);
+
+	_t_newest = now;
+	if (!_timer.isActive())
+		_timer.start();
 }
 
 
 void DVSEventWidget::
 setTrackingLine(int x, int y)
 {
+	if (x == _track_x && y == _track_y) return;
 	_track_x = x;
 	_track_y = y;
+	update();
 }
 
 
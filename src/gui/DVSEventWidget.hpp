@@ -2,27 +2,39 @@
 #define __DVSEVENTWIDGET_HPP__B36E956F_AC52_4740_9A93_3C82F0E75D71
 
 #include <memory>
+#include <vector>
+#include <cstdint>
 #include <QTimer>
 #include <QWidget>
 #include <QPaintEvent>
 #include <QImage>
+#include <QPainter>
+#include <QRect>
+#include "Datatypes.hpp"
+#include "EventPacketPool.hpp"
 
-namespace nst {
-
-// forward declarations
-struct DVSEvent;
-
-
-namespace gui {
+namespace nst { namespace gui {
 
 /**
  * DVSEventWidget - draw events received from a DVS.
+ *
+ * Each pixel stores the color and arrival time of its last event. The fading
+ * is computed from the elapsed time when the image gets painted, so incoming
+ * events cost two stores each. Repaints happen at most with the configured
+ * frame rate, and only while something is still fading, i.e. an idle robot
+ * costs nothing. The tracking line is drawn on top when painting.
  */
 class DVSEventWidget : public QWidget
 {
 	Q_OBJECT
 
 public:
+	static constexpr unsigned DVS_SIZE = 128;
+	static constexpr unsigned DEFAULT_MAX_FPS = 50;
+
+	// the decay factor applies per this interval
+	static constexpr int DECAY_INTERVAL_MS = 20;
+
 	explicit DVSEventWidget(QWidget *parent=nullptr);
 	~DVSEventWidget();
 
@@ -30,17 +42,42 @@ public:
 
 public slots:
 	void paintEvent(QPaintEvent *event);
-	void decayImage();
-	void newEvent(std::shared_ptr<DVSEvent> ev);
+	void newEvents(const DVSEventPacketPtr &packet);
+
+	/*
+	 * brightness that remains after each DECAY_INTERVAL_MS
+	 */
 	void setDecayFactor(float decay_factor);
 
+	/*
+	 * upper limit of repaints per second
+	 */
+	void setMaxFPS(unsigned fps);
+
+private slots:
+	void onRefreshTimeout();
+
 private:
+	// resolution of the decay table in microseconds
+	static constexpr uint64_t DECAY_STEP_US = 1000;
+
 	QTimer  _timer;
 	QImage *_image;
 	float   _decay_factor;
 	int _track_x, _track_y;
 
-	void decayPixel(unsigned *p);
+	// color and arrival time of the last event of each pixel
+	QRgb _pixel_color[DVS_SIZE * DVS_SIZE];
+	uint64_t _pixel_time[DVS_SIZE * DVS_SIZE];
+	uint64_t _t_newest = 0;
+
+	// remaining brightness (out of 256) after n decay steps. Pixels that
+	// are older than the table are black
+	std::vector<uint16_t> _decay_lut;
+
+	void renderImage(uint64_t now);
+	void drawTrackingLine(QPainter &p, const QRect &rect);
+	void setPixel(unsigned x, unsigned y, QRgb color, uint64_t t);
 };
 
 
@@ -25,7 +25,7 @@ EventVisualizerWindow(RobotControl *control, QWidget *parent, Qt::WindowFlags fl
 	layout()->addWidget(_wdgtEvents);
 
 	// connect the visualizer to the robotcontrol
-	connect(_control, &RobotControl::DVSEventReceived, _wdgtEvents, &DVSEventWidget::newEvent);
+	connect(_control, &RobotControl::DVSEventPacketReceived, _wdgtEvents, &DVSEventWidget::newEvents);
 
 	setAttribute(Qt::WA_DeleteOnClose);
 }
@@ -34,7 +34,7 @@ EventVisualizerWindow(RobotControl *control, QWidget *parent, Qt::WindowFlags fl
 EventVisualizerWindow::
 ~EventVisualizerWindow()
 {
-	disconnect(_control, &RobotControl::DVSEventReceived, _wdgtEvents, &DVSEventWidget::newEvent);
+	disconnect(_control, &RobotControl::DVSEventPacketReceived, _wdgtEvents, &DVSEventWidget::newEvents);
 }
 
 
@@ -44,6 +44,12 @@ setTrackingLine(int x, int y)
 	_wdgtEvents->setTrackingLine(x, y);
 }
 
+void EventVisualizerWindow::
+setMaxFPS(unsigned fps)
+{
+	_wdgtEvents->setMaxFPS(fps);
+}
+
 void EventVisualizerWindow::
 resizeEvent(QResizeEvent *ev)
 {
@@ -29,6 +29,11 @@ public:
 	void resizeEvent(QResizeEvent *ev) Q_DECL_OVERRIDE;
 	void setTrackingLine(int x, int y);
 
+	/*
+	 * limit the repaints of the event display
+	 */
+	void setMaxFPS(unsigned fps);
+
 public slots:
 	void closeEvent(QCloseEvent *ev) Q_DECL_OVERRIDE;
 
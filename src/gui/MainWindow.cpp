@@ -9,9 +9,11 @@
 #include <QApplication>
 #include <QToolBar>
 #include <QSizePolicy>
+#include <QTimer>
 
 #include "utils.hpp"
 #include "RCManager.hpp"
+#include "RobotControl.hpp"
 #include "gui/RobotControlWindow.hpp"
 #include "gui/EventVisualizerWindow.hpp"
 
@@ -52,6 +54,12 @@ MainWindow(QWidget *parent)
 	addRobotControl();
 
 	statusBar();
+
+	// show the latencies of all robots
+	_timer_status = new QTimer(this);
+	_timer_status->setInterval(1000);
+	connect(_timer_status, &QTimer::timeout, this, &MainWindow::onTimerStatusTimeout);
+	_timer_status->start();
 }
 
 
@@ -86,10 +94,31 @@ addRobotControl()
 }
 
 
+void MainWindow::
+onTimerStatusTimeout()
+{
+	// p50/p99 in ms from data arrival to event delivery and to commands
+	auto ms = [](uint64_t us) { return QString::number(us / 1000.0, 'f', 1); };
+
+	QString msg;
+	for (auto *ctrl: rcman_controls()) {
+		if (!ctrl->isConnected()) continue;
+		const auto &lat = ctrl->latencyStats();
+		if (!msg.isEmpty()) msg += "   ";
+		msg += QString("Robot %1: deliver %2/%3 ms, cmd %4/%5 ms")
+			.arg(static_cast<unsigned>(ctrl->id()))
+			.arg(ms(lat.deliver.percentile(0.5))).arg(ms(lat.deliver.percentile(0.99)))
+			.arg(ms(lat.command.percentile(0.5))).arg(ms(lat.command.percentile(0.99)));
+	}
+	statusBar()->showMessage(msg);
+}
+
+
 void MainWindow::
 onEmergencyShutdown()
 {
-	rcman_emergency_shutdown();
+	uint64_t worst = rcman_emergency_shutdown();
+	statusBar()->showMessage(QString("Emergency stop, worst-case latency %1 ms").arg(worst / 1000.0, 0, 'f', 2));
 }
 
 
@@ -9,6 +9,7 @@ class QMdiSubWindow;
 class QAction;
 class QMenu;
 class QToolBar;
+class QTimer;
 
 namespace nst { namespace gui {
 
@@ -25,6 +26,7 @@ public slots:
 	void addRobotControl();
 	void onEmergencyShutdown();
 	void onSubwindowClosing(QMdiSubWindow *win);
+	void onTimerStatusTimeout();
 
 private:
 	QMdiArea *_mdi = nullptr;
@@ -36,6 +38,8 @@ private:
 	QAction *_actEmergencyShutdown = nullptr;
 	QAction *_actAddRobotControl = nullptr;
 	QAction *_actClose = nullptr;
+
+	QTimer *_timer_status = nullptr;
 };
 
 
@@ -15,6 +15,9 @@
 #include <QDoubleValidator>
 #include <QIntValidator>
 #include <QSizePolicy>
+#include <QFont>
+#include <QFontDatabase>
+#include <QTimer>
 
 #include "utils.hpp"
 #include "RobotControl.hpp"
@@ -35,6 +38,7 @@ RobotControlWindow(QWidget *parent, Qt::WindowFlags flags)
 	_control = new RobotControl();
 	connect(_control, &RobotControl::connected, this, &RobotControlWindow::onControlConnected);
 	connect(_control, &RobotControl::disconnected, this, &RobotControlWindow::onControlDisconnected);
+	connect(_control, &RobotControl::reconnecting, this, &RobotControlWindow::onControlReconnecting);
 	connect(_control, &RobotControl::userFunctionData, this, &RobotControlWindow::onControlUserFunctionData);
 
 	// window frame
@@ -234,6 +238,29 @@ RobotControlWindow(QWidget *parent, Qt::WindowFlags flags)
 	_cbMagnetWindows->setCheckState(Qt::Checked);
 	layout->addWidget(_cbMagnetWindows, row, 0, 1, 3);
 
+	++row; {
+	auto line = new QFrame(_centralWidget);
+	line->setFrameShape(QFrame::HLine);
+	line->setFrameShadow(QFrame::Sunken);
+	layout->addWidget(line, row, 0, 1, 3);
+	}
+
+	++row;
+
+	// live metrics, to tell whether the link, the parser or the user
+	// function holds the robot back
+	_lblMetrics = new QLabel("", _centralWidget);
+	_lblMetrics->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+	_lblMetrics->setTextInteractionFlags(Qt::TextSelectableByMouse);
+	layout->addWidget(_lblMetrics, row, 0, 1, 3);
+
+	_metrics = _control->metrics();
+	_timerMetrics = new QTimer(this);
+	_timerMetrics->setInterval(1000);
+	connect(_timerMetrics, &QTimer::timeout, this, &RobotControlWindow::onTimerMetricsTimeout);
+	_timerMetrics->start();
+	onTimerMetricsTimeout();
+
 	_centralWidget->setLayout(layout);
 	setAttribute(Qt::WA_DeleteOnClose);
 }
@@ -262,7 +289,8 @@ closeEvent(QCloseEvent *ev)
 void RobotControlWindow::
 onBtnConnectClicked()
 {
-	if (!_control->isConnected())
+	// a link that is being re-established can only be given up
+	if (!_control->isConnected() && !_control->isReconnecting())
 		_control->connectRobot(_edtURI->text());
 	else
 		_control->disconnectRobot();
@@ -443,6 +471,18 @@ onControlDisconnected()
 }
 
 
+void RobotControlWindow::
+onControlReconnecting()
+{
+	// the robot's windows are closed already, but the link is not given
+	// up until the user says so
+	if (!_control->isReconnecting()) return;
+	_btnConnect->setText("disconnect");
+	_edtURI->setReadOnly(true);
+	_edtURI->setEnabled(false);
+}
+
+
 void RobotControlWindow::
 onControlUserFunctionData(int, int type, void *data)
 {
@@ -454,6 +494,38 @@ onControlUserFunctionData(int, int type, void *data)
 }
 
 
+void RobotControlWindow::
+onTimerMetricsTimeout()
+{
+	const auto m = _control->metrics();
+	const auto &p = _metrics;
+	auto num = [](double v, int prec) { return QString::number(v, 'f', prec); };
+
+	QString text;
+	text += QString("link    %1 MB/s in, %2 cmd/s, %3 B/s out\n")
+		.arg(num(m.rate(p, &RobotMetricsSnapshot::bytes_received) / 1e6, 2))
+		.arg(num(m.rate(p, &RobotMetricsSnapshot::commands_sent), 0))
+		.arg(num(m.rate(p, &RobotMetricsSnapshot::bytes_written), 0));
+	text += QString("parser  %1 kev/s, %2 imu/s, %3 resp, %4 resyncs\n")
+		.arg(num(m.rate(p, &RobotMetricsSnapshot::events_decoded) / 1e3, 1))
+		.arg(num(m.rate(p, &RobotMetricsSnapshot::imu_samples), 0))
+		.arg(m.responses)
+		.arg(m.resyncs);
+	text += QString("queue   %1/%2 events, drops in %3 ev %4 uf %5, rx stalls %6\n")
+		.arg(m.event_queue_depth)
+		.arg(m.event_queue_capacity)
+		.arg(m.input_drops)
+		.arg(m.event_queue_drops)
+		.arg(m.userfn_drops)
+		.arg(m.receive_buffer_exhausted);
+	text += QString("userfn  %1 us/call, %2% busy")
+		.arg(num(m.userfnTimePerCall(p), 1))
+		.arg(num(m.userfnLoad(p) * 100, 0));
+	_lblMetrics->setText(text);
+	_metrics = m;
+}
+
+
 void RobotControlWindow::
 onCbShowEventsStateChanged(int state)
 {
@@ -3,8 +3,11 @@
 
 #include <memory>
 #include <QMdiSubWindow>
+#include "RobotMetrics.hpp"
 
 class QFrame;
+class QLabel;
+class QTimer;
 class QCheckBox;
 class QLineEdit;
 class QPushButton;
@@ -59,8 +62,12 @@ private slots:
 	// control slots
 	void onControlConnected();
 	void onControlDisconnected();
+	void onControlReconnecting();
 	void onControlUserFunctionData(int id, int type, void *data);
 
+	// metrics panel
+	void onTimerMetricsTimeout();
+
 private:
 	void openEventVisualizerWindow();
 	void closeEventVisualizerWindow();
@@ -100,6 +107,12 @@ private:
 
 	QComboBox *_cmbUserFunction = nullptr;
 
+	// throughput of the robot, updated from the difference to the last
+	// snapshot
+	QLabel *_lblMetrics = nullptr;
+	QTimer *_timerMetrics = nullptr;
+	RobotMetricsSnapshot _metrics;
+
 	// 'sub'-windows
 	EventVisualizerWindow *_winEventVisualizer = nullptr;
 	NavigationWindow *_winNavigation = nullptr;
@@ -0,0 +1,277 @@
+#include "PushbotSimulator.hpp"
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include "StreamRecording.hpp"
+#include "utils.hpp"
+
+namespace nst { namespace sim {
+
+// the retina has 128x128 pixels
+static constexpr unsigned SENSOR_SIZE = 128;
+
+// stop generating data when the client does not keep up
+static constexpr qint64 MAX_PENDING_BYTES = 4 << 20;
+
+// the mask that Commands.hpp uses to enable gyro, accelerometer and
+// magnetometer. sensor type t is at bit 10 + t
+static constexpr unsigned IMU_MASK_DEFAULT = 7168;
+static constexpr unsigned IMU_MASK_SHIFT = 10;
+static constexpr unsigned IMU_PERIOD_DEFAULT_US = 8000;
+
+
+SimulatedPushbot::
+SimulatedPushbot(QTcpSocket *sock, const SimulatorConfig &cfg, QObject *parent)
+: QObject(parent), _sock(sock), _cfg(cfg)
+{
+	_sock->setParent(this);
+	_sock->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+	connect(_sock, &QTcpSocket::readyRead, this, &SimulatedPushbot::_sock_readyRead);
+	connect(_sock, &QTcpSocket::disconnected, this, &SimulatedPushbot::_sock_disconnected);
+
+	_timer = new QTimer(this);
+	_timer->setTimerType(Qt::PreciseTimer);
+	_timer->setInterval(1);
+	connect(_timer, &QTimer::timeout, this, &SimulatedPushbot::_tick);
+
+	if (!_cfg.replay_file.isEmpty()) {
+		_replayer = new StreamReplayer(this);
+		_replayer->setSpeed(_cfg.replay_speed);
+		connect(_replayer, &StreamReplayer::dataReady, this, &SimulatedPushbot::_replay_data);
+
+		// loop the recording until the client stops streaming
+		connect(_replayer, &StreamReplayer::finished, this, [this]{
+			if (_streaming && _replayer->open(_cfg.replay_file))
+				_replayer->start();
+		});
+	}
+	_t_start = monotonic_us();
+}
+
+
+SimulatedPushbot::
+~SimulatedPushbot()
+{ }
+
+
+void SimulatedPushbot::
+_sock_readyRead()
+{
+	_cmdline.append(_sock->readAll());
+
+	int nl;
+	while ((nl = _cmdline.indexOf('\n')) >= 0) {
+		handleCommand(_cmdline.left(nl).trimmed());
+		_cmdline.remove(0, nl + 1);
+	}
+}
+
+
+void SimulatedPushbot::
+_sock_disconnected()
+{
+	std::cout << "II: client disconnected" << std::endl;
+	_timer->stop();
+	deleteLater();
+}
+
+
+void SimulatedPushbot::
+handleCommand(const QByteArray &line)
+{
+	if (_cfg.verbose)
+		std::cout << "II: " << line.constData() << std::endl;
+
+	if (line.isEmpty())
+		return;
+
+	if (line == "E+")
+		setStreaming(true);
+	else if (line == "E-")
+		setStreaming(false);
+	else if (line == "!E0")
+		_timestamp_bytes = 0;
+	else if (line == "!E2")
+		_timestamp_bytes = 2;
+	else if (line == "!E3")
+		_timestamp_bytes = 3;
+	else if (line == "!E4")
+		_timestamp_bytes = 4;
+	else if (line.startsWith("!S+")) {
+		// !S+<mask>,<period in ms>
+		QList<QByteArray> args = line.mid(3).split(',');
+		_imu_mask = args.size() > 0 && !args[0].isEmpty() ? args[0].toUInt() : IMU_MASK_DEFAULT;
+		_imu_period_us = args.size() > 1 ? args[1].toUInt() * 1000 : IMU_PERIOD_DEFAULT_US;
+		_t_imu_next = monotonic_us();
+		if (!_timer->isActive()) _timer->start();
+	}
+	else if (line == "!S-")
+		_imu_mask = 0;
+	else if (line == "!M+")
+		_motors_enabled = true;
+	else if (line == "!M-")
+		_motors_enabled = false;
+	else if (line.startsWith("!M")) {
+		// !M<type><motor>=<value>, e.g. !MV0=20 or !MVD1=-30
+		int eq = line.indexOf('=');
+		if (eq < 3) return;
+		int motor = line.at(eq - 1) - '0';
+		if (motor == 0 || motor == 1)
+			_motor[motor] = line.mid(eq + 1).toInt();
+		if (_cfg.verbose)
+			std::cout << "II: motors " << (_motors_enabled ? "on" : "off") << " " << _motor[0] << " " << _motor[1] << std::endl;
+	}
+	// LEDs, buzzer and laser pointer have no visible effect here
+}
+
+
+void SimulatedPushbot::
+setStreaming(bool enabled)
+{
+	_streaming = enabled;
+
+	if (_replayer) {
+		if (enabled && !_replayer->isOpen() && _replayer->open(_cfg.replay_file))
+			_replayer->start();
+		if (!enabled)
+			_replayer->close();
+		return;
+	}
+
+	// synthetic events continue with the current time
+	auto now = monotonic_us();
+	_events_sent = (now - _t_start) * _cfg.event_rate / 1000000;
+	if (enabled && !_timer->isActive()) _timer->start();
+}
+
+
+void SimulatedPushbot::
+_tick()
+{
+	if (_sock->bytesToWrite() > MAX_PENDING_BYTES)
+		return;
+
+	QByteArray out;
+	auto now = monotonic_us();
+	if (_streaming && !_replayer)
+		appendEvents(out, now);
+	if (_imu_mask)
+		appendIMU(out, now);
+	if (!out.isEmpty())
+		_sock->write(out);
+
+	if (!_streaming && !_imu_mask)
+		_timer->stop();
+}
+
+
+void SimulatedPushbot::
+_replay_data(const QByteArray &data)
+{
+	if (_sock->bytesToWrite() <= MAX_PENDING_BYTES)
+		_sock->write(data);
+}
+
+
+/*
+ * a vertical bar that moves across the field of view once per second, plus
+ * some background noise
+ */
+void SimulatedPushbot::
+appendEvents(QByteArray &out, uint64_t now)
+{
+	const uint64_t t = now - _t_start;
+	const uint64_t due = t * _cfg.event_rate / 1000000;
+	if (due <= _events_sent) return;
+
+	const uint64_t n = due - _events_sent;
+	const unsigned bar = (t / (1000000 / SENSOR_SIZE)) % SENSOR_SIZE;
+	out.reserve(out.size() + n * (2 + _timestamp_bytes));
+
+	for (uint64_t i = 0; i < n; i++) {
+		_seed = _seed * 1103515245u + 12345u;
+		const uint64_t t_ev = (_events_sent + i) * 1000000 / _cfg.event_rate;
+		unsigned x = (_seed >> 8) % 8 ? (bar + ((_seed >> 12) & 0x3)) % SENSOR_SIZE : (_seed >> 12) % SENSOR_SIZE;
+		unsigned y = (_seed >> 16) % SENSOR_SIZE;
+		unsigned p = (_seed >> 24) & 0x1;
+
+		out.append(static_cast<char>(0x80 | x));
+		out.append(static_cast<char>((p << 7) | y));
+		for (unsigned b = _timestamp_bytes; b > 0; b--)
+			out.append(static_cast<char>((t_ev >> (8 * (b - 1))) & 0xFF));
+	}
+	_events_sent = due;
+}
+
+
+/*
+ * one response line per enabled sensor: a slow rotation for the gyroscope,
+ * gravity with some wobble for the accelerometer, and a constant magnetic
+ * field
+ */
+void SimulatedPushbot::
+appendIMU(QByteArray &out, uint64_t now)
+{
+	const uint64_t period = _cfg.imu_rate ? 1000000 / _cfg.imu_rate : _imu_period_us;
+	if (period == 0 || now < _t_imu_next) return;
+	_t_imu_next = now + period;
+
+	const double phase = 2.0 * M_PI * (now - _t_start) / 1e6;
+	const double values[3][3] = {
+		{0.1 * std::sin(phase), 0.1 * std::cos(phase), 0.05},
+		{0.02 * std::sin(3 * phase), 0.02 * std::cos(3 * phase), 1.0},
+		{0.3, 0.0, -0.4},
+	};
+
+	char line[64];
+	for (unsigned type = 0; type < 3; type++) {
+		if (!(_imu_mask & (1u << (IMU_MASK_SHIFT + type)))) continue;
+		int n = std::snprintf(line, sizeof(line), "-S1%u %08X %08X %08X\n", type,
+				static_cast<uint32_t>(static_cast<int32_t>(values[type][0] * 65536.0)),
+				static_cast<uint32_t>(static_cast<int32_t>(values[type][1] * 65536.0)),
+				static_cast<uint32_t>(static_cast<int32_t>(values[type][2] * 65536.0)));
+		out.append(line, n);
+	}
+}
+
+
+PushbotSimulator::
+PushbotSimulator(const SimulatorConfig &cfg, QObject *parent)
+: QObject(parent), _cfg(cfg)
+{
+	_server = new QTcpServer(this);
+	connect(_server, &QTcpServer::newConnection, this, &PushbotSimulator::_server_newConnection);
+}
+
+
+PushbotSimulator::
+~PushbotSimulator()
+{ }
+
+
+bool PushbotSimulator::
+listen(uint16_t port)
+{
+	if (!_server->listen(QHostAddress::Any, port)) {
+		std::cerr << "EE: Cannot listen on port " << port << ": " << _server->errorString().toStdString() << std::endl;
+		return false;
+	}
+	std::cout << "II: simulator listening on port " << _server->serverPort() << std::endl;
+	return true;
+}
+
+
+void PushbotSimulator::
+_server_newConnection()
+{
+	while (_server->hasPendingConnections()) {
+		std::cout << "II: client connected" << std::endl;
+		new SimulatedPushbot(_server->nextPendingConnection(), _cfg, this);
+	}
+}
+
+
+}} // nst::sim
@@ -0,0 +1,117 @@
+#ifndef __PUSHBOTSIMULATOR_HPP__E2A7C5D1_3B8F_4C6A_9D14_58F3A0B7E6C2
+#define __PUSHBOTSIMULATOR_HPP__E2A7C5D1_3B8F_4C6A_9D14_58F3A0B7E6C2
+
+#include <stdint.h>
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+
+// forward declarations
+class QTcpServer;
+class QTcpSocket;
+class QTimer;
+
+namespace nst {
+
+// forward declarations
+class StreamReplayer;
+
+namespace sim {
+
+
+/**
+ * configuration of the simulated robots
+ */
+struct SimulatorConfig
+{
+	// synthetic DVS events per second
+	unsigned event_rate = 100000;
+
+	// IMU samples per second and sensor. 0 uses the period that was
+	// requested with !S+
+	unsigned imu_rate = 0;
+
+	// if not empty, stream this recording instead of synthetic events
+	QString replay_file;
+	double replay_speed = 1.0;
+
+	// print all received commands
+	bool verbose = false;
+};
+
+
+/**
+ * SimulatedPushbot - one client connection to the simulator.
+ *
+ * Speaks the same protocol as the PushBot: it interprets the commands in
+ * Commands.hpp and streams events in the selected time format as well as IMU
+ * response lines.
+ */
+class SimulatedPushbot : public QObject
+{
+	Q_OBJECT
+
+public:
+	SimulatedPushbot(QTcpSocket *sock, const SimulatorConfig &cfg, QObject *parent = 0);
+	virtual ~SimulatedPushbot();
+
+private slots:
+	void _sock_readyRead();
+	void _sock_disconnected();
+	void _tick();
+	void _replay_data(const QByteArray &data);
+
+private:
+	void handleCommand(const QByteArray &line);
+	void setStreaming(bool enabled);
+	void appendEvents(QByteArray &out, uint64_t now);
+	void appendIMU(QByteArray &out, uint64_t now);
+
+	QTcpSocket *_sock;
+	QTimer *_timer;
+	StreamReplayer *_replayer = nullptr;
+	const SimulatorConfig &_cfg;
+
+	QByteArray _cmdline;
+
+	// state of the robot as set by commands
+	bool _streaming = false;
+	unsigned _timestamp_bytes = 3;
+	unsigned _imu_mask = 0;
+	unsigned _imu_period_us = 0;
+	bool _motors_enabled = false;
+	int _motor[2] = {0, 0};
+
+	// synthetic stream
+	uint64_t _t_start = 0;
+	uint64_t _events_sent = 0;
+	uint64_t _t_imu_next = 0;
+	uint32_t _seed = 42;
+};
+
+
+/**
+ * PushbotSimulator - TCP server that spawns a simulated robot for each client
+ */
+class PushbotSimulator : public QObject
+{
+	Q_OBJECT
+
+public:
+	PushbotSimulator(const SimulatorConfig &cfg, QObject *parent = 0);
+	virtual ~PushbotSimulator();
+
+	bool listen(uint16_t port = 56000);
+
+private slots:
+	void _server_newConnection();
+
+private:
+	QTcpServer *_server;
+	SimulatorConfig _cfg;
+};
+
+
+}} // nst::sim
+
+#endif /* __PUSHBOTSIMULATOR_HPP__E2A7C5D1_3B8F_4C6A_9D14_58F3A0B7E6C2 */
@@ -0,0 +1,49 @@
+/*
+ * pbrc_sim - simulates PushBots on a TCP port for end-to-end tests and load
+ * generation. Each client that connects gets its own simulated robot.
+ */
+#include <iostream>
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QCommandLineOption>
+#include "PushbotSimulator.hpp"
+
+int
+main(int argc, char *argv[])
+{
+	using namespace nst;
+
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("pbrc_sim");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("PushBot simulator");
+	parser.addHelpOption();
+	QCommandLineOption portOption({"p", "port"}, "TCP port to listen on.", "port", "56000");
+	QCommandLineOption rateOption({"r", "event-rate"}, "Synthetic DVS events per second.", "rate", "100000");
+	QCommandLineOption imuOption({"i", "imu-rate"}, "IMU samples per second, 0 to use the rate requested by !S+.", "rate", "0");
+	QCommandLineOption replayOption("replay", "Stream a recording instead of synthetic events.", "file");
+	QCommandLineOption speedOption("speed", "Replay speed, 0 for as fast as possible.", "speed", "1");
+	QCommandLineOption verboseOption({"v", "verbose"}, "Print all received commands.");
+	parser.addOption(portOption);
+	parser.addOption(rateOption);
+	parser.addOption(imuOption);
+	parser.addOption(replayOption);
+	parser.addOption(speedOption);
+	parser.addOption(verboseOption);
+	parser.process(app);
+
+	sim::SimulatorConfig cfg;
+	cfg.event_rate = parser.value(rateOption).toUInt();
+	cfg.imu_rate = parser.value(imuOption).toUInt();
+	cfg.replay_file = parser.value(replayOption);
+	cfg.replay_speed = parser.value(speedOption).toDouble();
+	cfg.verbose = parser.isSet(verboseOption);
+	if (cfg.event_rate == 0) cfg.event_rate = 1;
+
+	sim::PushbotSimulator simulator(cfg);
+	if (!simulator.listen(parser.value(portOption).toUShort()))
+		return 1;
+
+	return app.exec();
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <algorithm>
+#include <chrono>
 #include <deque>
 #include <iostream>
 #include <memory>
@@ -49,5 +50,14 @@ std::unique_ptr<T> make_unique(Args&&... args)
     return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
 }
 
+/**
+ * current time of the host's monotonic clock in microseconds
+ */
+inline uint64_t monotonic_us()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
 #endif /* __UTILS_HPP__B69DECA2_4EA9_41CC_9E83_A9BBBB6E06C6 */
 